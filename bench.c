@@ -0,0 +1,219 @@
+/*
+ * bench.c
+ *
+ *  ChibiOS test suite and kernel benchmarks run from the shell.
+ *
+ *  TestThread (test.mk) runs the whole suite, the functional tests then
+ *  the benchmarks: messages, context switch, thread creation, reschedules,
+ *  round robin, I/O queues, virtual timers, semaphores, mutexes and the
+ *  RAM footprint of the objects. It runs at the priority of the shell with
+ *  our chconf.h, so the other threads (USB, accelerometer, log writers)
+ *  compete as they do in use.
+ *
+ *  The suite prints to a BenchStream. It forwards to the shell, everything
+ *  for selftest and only the benchmark test cases for bench, and turns
+ *  the result lines of the benchmarks ("--- Score : 239868 msgs/S, ...")
+ *  into CSV rows: case, name, label, value, unit. tools/benchdiff.py
+ *  compares two of those files.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+#include "test.h"
+
+#include "fat.h"
+#include "fwriter.h"
+#include "bench.h"
+
+static WORKING_AREA(benchWA, BENCH_WA_SIZE);
+
+/*
+ * "12.1 (Benchmark, messages #1)" becomes 12.1,"Benchmark, messages #1".
+ */
+static void bench_case(BenchStream *bsp, const char *p) {
+	size_t n, m;
+
+	n = strcspn(p, " ");
+	memcpy(bsp->name, p, n);
+	bsp->name[n++] = ',';
+	bsp->name[n++] = '"';
+	p = strchr(p, '(') + 1;
+	m = strcspn(p, ")");
+	if (m > sizeof(bsp->name) - n - 2) {
+		m = sizeof(bsp->name) - n - 2;
+	}
+	memcpy(bsp->name + n, p, m);
+	bsp->name[n + m] = '"';
+	bsp->name[n + m + 1] = '\0';
+}
+
+/*
+ * "Score : 239868 msgs/S, 479736 ctxswc/S" or "System: 360 bytes", a row
+ * per value. Lines without a number after the colon are not results.
+ */
+static void bench_values(BenchStream *bsp, char *p) {
+	char *label = p, *unit, *end;
+	uint32_t value;
+
+	p = strchr(p, ':');
+	if (p == NULL) {
+		return;
+	}
+	for (end = p; end > label && end[-1] == ' '; end--) {
+	}
+	*end = '\0';
+	p++;
+	while (*p != '\0') {
+		value = strtoul(p, &unit, 10);
+		if (unit == p) {
+			return;
+		}
+		while (*unit == ' ') {
+			unit++;
+		}
+		p = strchr(unit, ',');
+		if (p != NULL) {
+			*p++ = '\0';
+		} else {
+			p = unit + strlen(unit);
+		}
+		chprintf(bsp->csv, "%s,%s,%lu,%s\r\n", bsp->name, label, value, unit);
+		bsp->results++;
+	}
+}
+
+static void bench_line(BenchStream *bsp) {
+	char *p = bsp->line;
+
+	if (strncmp(p, "--- Test Case ", 14) == 0) {
+		bsp->inbench = strstr(p, "(Benchmark") != NULL;
+		if (bsp->inbench) {
+			bench_case(bsp, p + 14);
+		}
+	}
+	if (bsp->scores && (bsp->inbench || strstr(p, "FAILURE") != NULL)) {
+		chprintf(bsp->out, "%s\r\n", p);
+	}
+	if (bsp->inbench && bsp->csv != NULL && strncmp(p, "--- ", 4) == 0 &&
+			strncmp(p, "--- Test Case ", 14) != 0 &&
+			strncmp(p, "--- Result", 10) != 0) {
+		bench_values(bsp, p + 4);
+	}
+}
+
+static msg_t put(void *ip, uint8_t b) {
+	BenchStream *bsp = ip;
+	msg_t msg = Q_OK;
+
+	if (!bsp->scores) {
+		msg = chSequentialStreamPut(bsp->out, b);
+	}
+	if (b == '\n') {
+		bsp->line[bsp->n] = '\0';
+		bench_line(bsp);
+		bsp->n = 0;
+	} else if (b != '\r' && bsp->n < BENCH_LINE_SIZE - 1) {
+		bsp->line[bsp->n++] = (char)b;
+	}
+	return msg;
+}
+
+static size_t writes(void *ip, const uint8_t *bp, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		put(ip, bp[i]);
+	}
+	return n;
+}
+
+static size_t reads(void *ip, uint8_t *bp, size_t n) {
+	return chSequentialStreamRead(((BenchStream *)ip)->out, bp, n);
+}
+
+static msg_t get(void *ip) {
+	return chSequentialStreamGet(((BenchStream *)ip)->out);
+}
+
+static const struct BenchStreamVMT vmt = {writes, reads, put, get};
+
+/*
+ * The CSV buffer holds BENCH_CSV_ROWS rows of up to a parsed line each, so
+ * that the file is only written once the benchmarks are over. More rows
+ * would be written out during the run.
+ */
+#define BENCH_CSV_SIZE                                                      \
+  ((BENCH_CSV_ROWS * BENCH_LINE_SIZE + MMCSD_BLOCK_SIZE - 1) /              \
+   MMCSD_BLOCK_SIZE * MMCSD_BLOCK_SIZE)
+
+static void bench_run(BaseSequentialStream *chp, bool_t scores,
+		const char *path) {
+	static FileWriter fw;
+	static uint8_t buf[BENCH_CSV_SIZE];         /* In SRAM, SDIO DMA source.*/
+	BenchStream bs;
+	Thread *tp;
+	FRESULT err;
+
+	bs.vmt = &vmt;
+	bs.out = chp;
+	bs.csv = NULL;
+	bs.scores = scores;
+	bs.inbench = FALSE;
+	bs.n = 0;
+	bs.results = 0;
+	if (path != NULL) {
+		fwObjectInit(&fw, buf, sizeof(buf));
+		err = fwOpen(&fw, path, FA_WRITE | FA_CREATE_ALWAYS);
+		if (err != FR_OK) {
+			chprintf(chp, "BENCH: f_open(\"%s\") failed\r\n", path);
+			verbose_error(chp, err);
+			return;
+		}
+		chprintf((BaseSequentialStream *)&fw, "case,name,label,value,unit\r\n");
+		bs.csv = (BaseSequentialStream *)&fw;
+	}
+	if (scores) {
+		chprintf(chp, "Running the test suite, the benchmarks come last...\r\n");
+	}
+	tp = chThdCreateStatic(benchWA, sizeof(benchWA), chThdGetPriority(),
+		TestThread, &bs);
+	chThdWait(tp);
+	if (path == NULL) {
+		return;
+	}
+	err = fw.err;
+	if (err == FR_OK) {
+		err = fwClose(&fw);
+	} else {
+		fwClose(&fw);
+	}
+	if (err != FR_OK) {
+		chprintf(chp, "BENCH: writing %s failed\r\n", path);
+		verbose_error(chp, err);
+	} else {
+		chprintf(chp, "BENCH: %lu results written to %s\r\n", bs.results, path);
+	}
+}
+
+void cmd_selftest(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if (argc > 1) {
+		chprintf(chp, "Usage: selftest [file]\r\n");
+		chprintf(chp, "       Runs the ChibiOS test suite, [file] gets the benchmark results as CSV\r\n");
+		return;
+	}
+	bench_run(chp, FALSE, argc > 0 ? argv[0] : NULL);
+}
+
+void cmd_bench(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if (argc > 1) {
+		chprintf(chp, "Usage: bench [file]\r\n");
+		chprintf(chp, "       Prints the kernel benchmark results, [file] gets them as CSV\r\n");
+		return;
+	}
+	bench_run(chp, TRUE, argc > 0 ? argv[0] : NULL);
+}
@@ -0,0 +1,62 @@
+/*
+ * bench.h
+ *
+ *  ChibiOS test suite and kernel benchmarks run from the shell.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+/**
+ * @brief   Stack of the thread running the test suite.
+ * @details Its prints run the BenchStream line parser, which can print a
+ *          CSV row into a FileWriter and reach f_write().
+ */
+#if !defined(BENCH_WA_SIZE)
+#define BENCH_WA_SIZE           1024
+#endif
+
+/**
+ * @brief   CSV rows buffered before the file is written, the suite of
+ *          ChibiOS 2.6 gives about 26.
+ */
+#if !defined(BENCH_CSV_ROWS)
+#define BENCH_CSV_ROWS          32
+#endif
+
+/**
+ * @brief   Longest line of the test suite output parsed, longer ones are
+ *          cut.
+ */
+#if !defined(BENCH_LINE_SIZE)
+#define BENCH_LINE_SIZE         80
+#endif
+
+/**
+ * @brief   @p BenchStream virtual methods table.
+ */
+struct BenchStreamVMT {
+  _base_sequential_stream_methods
+};
+
+/**
+ * @brief   Stream the test suite prints to, forwards to the shell and
+ *          picks the benchmark results out of the lines.
+ */
+typedef struct {
+  const struct BenchStreamVMT *vmt;
+  _base_sequential_stream_data
+  BaseSequentialStream *out;
+  BaseSequentialStream *csv;    /* Results as CSV rows, NULL if none.       */
+  bool_t scores;                /* Only the benchmarks are printed.         */
+  bool_t inbench;               /* In a benchmark test case.                */
+  uint32_t n;
+  uint32_t results;
+  char line[BENCH_LINE_SIZE];
+  char name[BENCH_LINE_SIZE];   /* Current test case, "12.1,Benchmark...".  */
+} BenchStream;
+
+void cmd_selftest(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_bench(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* BENCH_H_ */
@@ -0,0 +1,68 @@
+/*
+ * boot.c
+ *
+ *  Boot phase timestamps from the DWT cycle counter.
+ *
+ *  sysmonInit() zeroes the cycle counter at the top of main(), the phases
+ *  record the cycles and the system time when first reached, from threads
+ *  and interrupts alike. The counter wraps after 25s at 168MHz, later
+ *  phases (a host enumerating the device long after reset) fall back to
+ *  the system tick.
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+
+#include "boot.h"
+
+static const char *bootPhases[BOOT_PHASES] = {
+	"main", "hal", "kernel", "init", "mems config", "first sample",
+	"sd mounted", "usb connect", "usb configured", "shell"
+};
+
+static uint32_t bootCycles[BOOT_PHASES];
+static systime_t bootTicks[BOOT_PHASES];
+static uint32_t bootMarked = 1U << BOOT_MAIN;
+
+void bootMark(bootphase_t phase) {
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if ((bootMarked & (1U << phase)) == 0) {
+		bootCycles[phase] = DWT->CYCCNT;
+		bootTicks[phase] = chTimeNow();
+		bootMarked |= 1U << phase;
+	}
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Microseconds since main() of a phase.
+ */
+static uint32_t boot_us(bootphase_t phase) {
+	if (bootTicks[phase] < S2ST(20)) {
+		return bootCycles[phase] / (STM32_HCLK / 1000000);
+	}
+	return bootTicks[phase] * (1000000 / CH_FREQUENCY);
+}
+
+void cmd_boot(BaseSequentialStream *chp, int argc, char *argv[]) {
+	uint32_t i;
+
+	(void)argv;
+	if (argc > 0) {
+		chprintf(chp, "Usage: boot\r\n");
+		return;
+	}
+	chprintf(chp, "phase            ms since main\r\n");
+	for (i = 0; i < BOOT_PHASES; i++) {
+		if (bootMarked & (1U << i)) {
+			chprintf(chp, "%-16s %9lu.%03lu\r\n", bootPhases[i],
+				boot_us(i) / 1000, boot_us(i) % 1000);
+		} else {
+			chprintf(chp, "%-16s %13s\r\n", bootPhases[i], "-");
+		}
+	}
+}
@@ -0,0 +1,30 @@
+/*
+ * boot.h
+ *
+ *  Boot phase timestamps from the DWT cycle counter.
+ */
+
+#ifndef BOOT_H_
+#define BOOT_H_
+
+/**
+ * @brief   Boot phases, each timestamped the first time it is reached.
+ */
+typedef enum {
+  BOOT_MAIN = 0,            /* Entry of main(), the time origin.            */
+  BOOT_HAL,                 /* halInit() done.                              */
+  BOOT_KERNEL,              /* chSysInit() done.                            */
+  BOOT_INIT,                /* Modules initialized, threads started.        */
+  BOOT_MEMS_CONFIG,         /* LIS302DL configured.                         */
+  BOOT_FIRST_SAMPLE,        /* First accelerometer sample read.             */
+  BOOT_SD_MOUNTED,          /* SD card mounted.                             */
+  BOOT_USB_CONNECT,         /* D+ pull-up on, after the disconnect delay.   */
+  BOOT_USB_CONFIGURED,      /* Configured by the host.                      */
+  BOOT_SHELL,               /* Shell started.                               */
+  BOOT_PHASES
+} bootphase_t;
+
+void bootMark(bootphase_t phase);
+void cmd_boot(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* BOOT_H_ */
@@ -448,7 +448,9 @@
  */
 #if !defined(THREAD_EXT_FIELDS) || defined(__DOXYGEN__)
 #define THREAD_EXT_FIELDS                                                   \
-  /* Add threads custom fields here.*/
+  /* CPU cycles run and top of the stack, see sysmon.c.*/                   \
+  uint32_t p_cycles;                                                        \
+  uint8_t *p_stktop;
 #endif
 
 /**
@@ -460,7 +462,8 @@
  */
 #if !defined(THREAD_EXT_INIT_HOOK) || defined(__DOXYGEN__)
 #define THREAD_EXT_INIT_HOOK(tp) {                                          \
-  /* Add threads initialization code here.*/                                \
+  (tp)->p_cycles = 0;                                                       \
+  (tp)->p_stktop = (uint8_t *)(tp)->p_ctx.r13 + sizeof(struct intctx);      \
 }
 #endif
 
@@ -484,7 +487,13 @@
  */
 #if !defined(THREAD_CONTEXT_SWITCH_HOOK) || defined(__DOXYGEN__)
 #define THREAD_CONTEXT_SWITCH_HOOK(ntp, otp) {                              \
-  /* System halt code here.*/                                               \
+  uint32_t now = SYSMON_CYCCNT;                                             \
+  (otp)->p_cycles += now - sysmonLastSwitch;                                \
+  sysmonLastSwitch = now;                                                   \
+  sysmonIdleLast = now;                                                     \
+  sysmonSwitches++;                                                         \
+  if (TRACE_ENABLE)                                                         \
+    traceSwitch(ntp);                                                       \
 }
 #endif
 
@@ -494,7 +503,13 @@
  */
 #if !defined(IDLE_LOOP_HOOK) || defined(__DOXYGEN__)
 #define IDLE_LOOP_HOOK() {                                                  \
-  /* Idle loop code here.*/                                                 \
+  uint32_t now = SYSMON_CYCCNT;                                             \
+  if (now - sysmonIdleLast > SYSMON_IDLE_GAP) {                             \
+    sysmonIrqCycles += now - sysmonIdleLast;                                \
+    if (TRACE_ENABLE)                                                       \
+      traceIrq(sysmonIdleLast, now - sysmonIdleLast);                       \
+  }                                                                         \
+  sysmonIdleLast = now;                                                     \
 }
 #endif
 
@@ -522,6 +537,31 @@
 
 /** @} */
 
+/*
+ * Counters updated by the hooks above, see sysmon.c. An idle loop pass
+ * longer than SYSMON_IDLE_GAP cycles was interrupted. The hooks expand in
+ * kernel sources without the CMSIS headers, DWT_CYCCNT is read directly.
+ */
+#if !defined(_FROM_ASM_)
+#include <stdint.h>
+#define SYSMON_IDLE_GAP                 48
+#define SYSMON_CYCCNT                   (*(volatile uint32_t *)0xE0001004U)
+extern volatile uint32_t sysmonLastSwitch;
+extern volatile uint32_t sysmonIdleLast;
+extern volatile uint32_t sysmonSwitches;
+extern volatile uint32_t sysmonIrqCycles;
+
+/*
+ * Event trace, see trace.c. Set by USE_TRACE in the Makefile.
+ */
+#if !defined(TRACE_ENABLE)
+#define TRACE_ENABLE                    TRUE
+#endif
+struct Thread;
+void traceSwitch(struct Thread *ntp);
+void traceIrq(uint32_t start, uint32_t cycles);
+#endif
+
 /*===========================================================================*/
 /* Port-specific settings (override port settings defaulted in chcore.h).    */
 /*===========================================================================*/
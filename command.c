@@ -13,11 +13,21 @@ Thread *_cmd_shell = NULL;
 bool _cmd_debug=FALSE;
 bool _cmd_shell_running=FALSE;
 
-#define SHELL_WA_SIZE   THD_WA_SIZE(2048)
-#define TEST_WA_SIZE    THD_WA_SIZE(256)
+#define SHELL_WA_SIZE   2048
+
+/*
+ * Shell sessions, a terminated shell leaves the registry at once so its
+ * working area is reused by the next connection without touching the heap.
+ * In SRAM, commands hand stack buffers to the SDIO DMA.
+ */
+static WORKING_AREA(cmdShellWA[CMD_SHELL_SESSIONS], SHELL_WA_SIZE);
+static Thread *cmdShells[CMD_SHELL_SESSIONS];
+static uint32_t cmdShellStarts, cmdShellPeak, cmdShellRefused;
 
 void cmd_mem(BaseSequentialStream *chp, int argc, char *argv[]) {
+  const FsPoolStats *ps;
   size_t n, size;
+  uint32_t i;
   (void)argv;
   if (argc > 0) {
     chprintf(chp, "Usage: mem\r\n");
@@ -27,25 +37,46 @@ void cmd_mem(BaseSequentialStream *chp, int argc, char *argv[]) {
   chprintf(chp, "core free memory : %u bytes\r\n", chCoreStatus());
   chprintf(chp, "heap fragments   : %u\r\n", n);
   chprintf(chp, "heap free total  : %u bytes\r\n", size);
+  chprintf(chp, "CCM used         : %lu of %lu bytes\r\n", memCcmUsed(), CCM_SIZE);
+  for (i = 0, n = 0; i < CMD_SHELL_SESSIONS; i++) {
+    n += cmdShells[i] != NULL;
+  }
+  chprintf(chp, "shell sessions   : %u of %u, %lu peak, %lu starts, %lu refused, %u bytes each\r\n",
+           n, CMD_SHELL_SESSIONS, cmdShellPeak, cmdShellStarts, cmdShellRefused,
+           sizeof(cmdShellWA[0]));
+  chprintf(chp, "pool  size count used peak fails\r\n");
+  for (i = 0; (ps = fsPoolGetStats(i)) != NULL; i++) {
+    chprintf(chp, "%-4s %5lu %5lu %4lu %4lu %5lu\r\n", ps->name, ps->size,
+             ps->count, ps->used, ps->peak, ps->fails);
+  }
 }
 
 void cmd_threads(BaseSequentialStream *chp, int argc, char *argv[]) {
   static const char *states[] = {THD_STATE_NAMES};
   Thread *tp;
+  size_t size, used;
   (void)argv;
   if (argc > 0) {
     chprintf(chp, "Usage: threads\r\n");
+    chprintf(chp, "       Stack peak use over %u%% is flagged with !\r\n",
+             SYSMON_STACK_WARN);
     return;
   }
-  chprintf(chp, "    addr    stack prio refs     state time\r\n");
+  chprintf(chp, "    addr    stack prio refs     state  size  used  time name\r\n");
   tp = chRegFirstThread();
   do {
-    chprintf(chp, "%.8lx %.8lx %4lu %4lu %9s %lu\r\n",
+    sysmonThreadStack(tp, &size, &used);
+    chprintf(chp, "%.8lx %.8lx %4lu %4lu %9s %5u %5u%c %lu %s\r\n",
              (uint32_t)tp, (uint32_t)tp->p_ctx.r13,
              (uint32_t)tp->p_prio, (uint32_t)(tp->p_refs - 1),
-             states[tp->p_state], (uint32_t)tp->p_time);
+             states[tp->p_state], size, used,
+             used * 100 > size * SYSMON_STACK_WARN ? '!' : ' ',
+             (uint32_t)tp->p_time, tp->p_name != NULL ? tp->p_name : "");
     tp = chRegNextThread(tp);
   } while (tp != NULL);
+  sysmonIrqStack(&size, &used);
+  chprintf(chp, "%38s%5u %5u%c   interrupts\r\n",
+           "", size, used, used * 100 > size * SYSMON_STACK_WARN ? '!' : ' ');
 }
 
 void cmd_debug(BaseSequentialStream *chp, int argc, char *argv[]) {
@@ -72,21 +103,161 @@ void cmdSetDebug(bool debug) {
   _cmd_debug = debug;
 }
 
+/*
+ * The long running commands also take a trailing "&" to run as a job.
+ */
+JOB_COMMAND(cmd_mkfs)
+JOB_COMMAND(cmd_tree)
+JOB_COMMAND(cmd_sdinfo)
+JOB_COMMAND(cmd_sdbench)
+JOB_COMMAND(cmd_hello)
+JOB_COMMAND(cmd_cat)
+JOB_COMMAND(cmd_cp)
+JOB_COMMAND(cmd_rawlog)
+#if TRACE_ENABLE
+JOB_COMMAND(cmd_trace)
+#endif
+
 static const ShellCommand commands[] = {
-  {"mkfs", cmd_mkfs},
+  {"mkfs", cmd_mkfs_job},
   {"mount", cmd_mount},
   {"unmount", cmd_unmount},
-  {"tree", cmd_tree},
+  {"tree", cmd_tree_job},
   {"free", cmd_free},
+  {"sdinfo", cmd_sdinfo_job},
+  {"sdbench", cmd_sdbench_job},
+  {"diskstat", cmd_diskstat},
   {"mkdir", cmd_mkdir},
-  {"hello", cmd_hello},
-  {"cat", cmd_cat},
+  {"hello", cmd_hello_job},
+  {"cat", cmd_cat_job},
+  {"cp", cmd_cp_job},
+  {"ramdisk", cmd_ramdisk},
+  {"rawlog", cmd_rawlog_job},
+  {"logs", cmd_logs},
+  {"sync", cmd_sync},
+  {"jobs", cmd_jobs},
+  {"fg", cmd_fg},
+  {"kill", cmd_kill},
   {"mem", cmd_mem},
   {"threads", cmd_threads},
+  {"top", cmd_top},
+  {"memsstat", cmd_memsstat},
+  {"stats", cmd_stats},
+  {"prof", cmd_prof},
+  {"time", cmd_time},
+  {"selftest", cmd_selftest},
+  {"bench", cmd_bench},
+  {"boot", cmd_boot},
+#if TIMING_ENABLE
+  {"timing", cmd_timing},
+#endif
+#if TRACE_ENABLE
+  {"trace", cmd_trace_job},
+#endif
   {"debug", cmd_debug},
   {NULL, NULL}
 };
 
+/*
+ * Stream handed to the command run by time, forwards to the shell stream
+ * and counts the bytes written.
+ */
+struct TimeStreamVMT {
+  _base_sequential_stream_methods
+};
+
+typedef struct {
+  const struct TimeStreamVMT *vmt;
+  _base_sequential_stream_data
+  BaseSequentialStream *out;
+  uint32_t written;
+} TimeStream;
+
+static size_t time_writes(void *ip, const uint8_t *bp, size_t n) {
+  TimeStream *tsp = ip;
+
+  n = chSequentialStreamWrite(tsp->out, bp, n);
+  tsp->written += n;
+  return n;
+}
+
+static size_t time_reads(void *ip, uint8_t *bp, size_t n) {
+  return chSequentialStreamRead(((TimeStream *)ip)->out, bp, n);
+}
+
+static msg_t time_put(void *ip, uint8_t b) {
+  TimeStream *tsp = ip;
+  msg_t msg;
+
+  msg = chSequentialStreamPut(tsp->out, b);
+  if (msg == Q_OK) {
+    tsp->written++;
+  }
+  return msg;
+}
+
+static msg_t time_get(void *ip) {
+  return chSequentialStreamGet(((TimeStream *)ip)->out);
+}
+
+static const struct TimeStreamVMT time_vmt = {
+  time_writes, time_reads, time_put, time_get
+};
+
+/*
+ * Runs a command in the shell thread and reports its wall time, the cycles
+ * charged to the shell thread, the SD sectors moved and the bytes printed.
+ * The SD counters are global, a log written meanwhile counts too. The
+ * cycle count is 32 bit, it wraps after 25s of CPU at 168MHz. fg reads
+ * keys from the USB serial channel, the counting stream is not one.
+ */
+void cmd_time(BaseSequentialStream *chp, int argc, char *argv[]) {
+  const ShellCommand *scp;
+  const DiskStats *dsp;
+  TimeStream ts;
+  systime_t start;
+  uint32_t cycles, rsectors, wsectors, ms;
+
+  if (argc < 1) {
+    chprintf(chp, "Usage: time command [args]\r\n");
+    chprintf(chp, "       The cpu cycles wrap after %lu s of CPU time\r\n",
+             0xFFFFFFFFU / STM32_HCLK);
+    return;
+  }
+  if (strcmp(argv[argc - 1], "&") == 0) {
+    chprintf(chp, "time: cannot time a job\r\n");
+    return;
+  }
+  if (strcmp(argv[0], "fg") == 0) {
+    chprintf(chp, "time: cannot time fg, it needs the USB serial channel\r\n");
+    return;
+  }
+  for (scp = commands; scp->sc_name != NULL; scp++) {
+    if (strcmp(scp->sc_name, argv[0]) == 0) {
+      break;
+    }
+  }
+  if (scp->sc_name == NULL) {
+    chprintf(chp, "time: %s not found\r\n", argv[0]);
+    return;
+  }
+  ts.vmt = &time_vmt;
+  ts.out = chp;
+  ts.written = 0;
+  dsp = diskGetStats();
+  rsectors = dsp->rsectors;
+  wsectors = dsp->wsectors;
+  start = chTimeNow();
+  cycles = sysmonSelfCycles();
+  scp->sc_function((BaseSequentialStream *)&ts, argc - 1, argv + 1);
+  cycles = sysmonSelfCycles() - cycles;
+  ms = (chTimeNow() - start) * 1000 / CH_FREQUENCY;
+  chprintf(chp, "real %lu ms, cpu %lu cycles (%lu%%)\r\n", ms, cycles,
+           ms > 0 ? cycles / (ms * (STM32_HCLK / 100000)) : 0);
+  chprintf(chp, "sd %lu sectors read, %lu written, usb %lu bytes\r\n",
+           dsp->rsectors - rsectors, dsp->wsectors - wsectors, ts.written);
+}
+
 static const ShellConfig _shell_cfg1 = {
   (BaseSequentialStream *)&SDU1,
   commands
@@ -101,12 +272,34 @@ bool cmdIsShellTerminated() {
 }
 
 void cmdShellCreate() {
-  _cmd_shell = shellCreate(&_shell_cfg1, SHELL_WA_SIZE, NORMALPRIO);
+  unsigned i, n = 0;
+
+  for (i = 0; i < CMD_SHELL_SESSIONS && cmdShells[i] != NULL; i++) {
+    n++;
+  }
+  if (i == CMD_SHELL_SESSIONS) {
+    cmdShellRefused++;
+    return;
+  }
+  _cmd_shell = shellCreateStatic(&_shell_cfg1, cmdShellWA[i],
+                                 sizeof(cmdShellWA[i]), NORMALPRIO);
+  cmdShells[i] = _cmd_shell;
+  cmdShellStarts++;
+  bootMark(BOOT_SHELL);
+  if (n + 1 > cmdShellPeak) {
+    cmdShellPeak = n + 1;
+  }
   _cmd_shell_running = TRUE;
 }
 
 void cmdShellRelease() {
-  chThdRelease(_cmd_shell);
+  unsigned i;
+
+  for (i = 0; i < CMD_SHELL_SESSIONS; i++) {
+    if (cmdShells[i] == _cmd_shell) {
+      cmdShells[i] = NULL;
+    }
+  }
   _cmd_shell_running = FALSE;
 }
 
@@ -13,10 +13,34 @@
 #include "ff.h"
 /* Project includes */
 #include "fat.h"
+#include "disk.h"
+#include "rawlog.h"
+#include "fwriter.h"
+#include "fspool.h"
+#include "memmap.h"
+#include "jobs.h"
+#include "sysmon.h"
+#include "trace.h"
+#include "mems.h"
+#include "metrics.h"
+#include "prof.h"
+#include "timing.h"
+#include "bench.h"
+#include "boot.h"
+
+/**
+ * @brief   Shell sessions that can run at once.
+ * @details Each one has a static working area reused across USB reconnects.
+ *          One per stream, there is a single USB serial port.
+ */
+#if !defined(CMD_SHELL_SESSIONS)
+#define CMD_SHELL_SESSIONS  1
+#endif
 
 void cmd_mem(BaseSequentialStream *chp, int argc, char *argv[]);
 void cmd_threads(BaseSequentialStream *chp, int argc, char *argv[]);
 void cmd_debug(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_time(BaseSequentialStream *chp, int argc, char *argv[]);
 bool cmdGetDebug(void);
 void cmdSetDebug(bool);
 bool cmdIsShellRunning(void);
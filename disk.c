@@ -0,0 +1,482 @@
+/*
+ * disk.c
+ *
+ *  FatFs disk I/O layer for the SDC driver and the RAM disk.
+ *
+ *  Replaces the generic ChibiOS binding so that the card geometry read by
+ *  sdcard.c reaches f_mkfs() and so that every access to the SDC driver,
+ *  FatFs or raw, goes through the same lock.
+ *
+ *  Multi-block writes are announced to the card with ACMD23 so it can
+ *  pre-erase, and the cluster runs FatFs frees (CTRL_ERASE_SECTOR) are
+ *  erased later by a low priority thread once no transfer happened for
+ *  DISK_TRIM_IDLE_MS, a few ms worth of erase per lock hold.
+ *
+ *  Drive 1 is the RAM disk of ramdisk.c.
+ *
+ *  A failed transfer is retried with backoff and card resets before the
+ *  error reaches FatFs, whose state (open files, sector window) stays valid
+ *  as the transfer is simply replayed.
+ */
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+#include "ffconf.h"
+#include "diskio.h"
+
+#include "chprintf.h"
+
+#include "disk.h"
+#include "memmap.h"
+#include "metrics.h"
+#include "ramdisk.h"
+#include "sdcard.h"
+#include "trace.h"
+
+#if HAL_USE_RTC
+#include "chrtclib.h"
+extern RTCDriver RTCD1;
+#endif
+
+/*
+ * Physical drive numbers.
+ */
+#define SDC     0
+#define RAM     RAMDISK_DRIVE
+
+/*
+ * Serializes the users of SDCD1.
+ */
+static MUTEX_DECL(diskMtx);
+
+static DiskStats diskStats;
+static systime_t diskLastTransfer;  /* Time of the last read or write.*/
+
+/*
+ * Pending erase ranges, inclusive. A range is dropped as soon as one of its
+ * sectors is written again, losing a hint is always safe.
+ */
+static struct {
+	uint32_t start;
+	uint32_t end;
+} diskTrims[DISK_TRIM_QUEUE];
+static uint32_t diskTrimCount;
+static BSEMAPHORE_DECL(diskTrimSem, TRUE);
+
+void diskLock(void) {
+	chMtxLock(&diskMtx);
+}
+
+void diskUnlock(void) {
+	chMtxUnlock();
+}
+
+/*
+ * Connect the card if it is not, under the lock so that no transfer or
+ * erase sees the driver half initialized.
+ */
+bool_t diskConnect(void) {
+	bool_t err = CH_SUCCESS;
+
+	diskLock();
+	if (blkGetDriverState(&SDCD1) != BLK_READY) {
+		err = sdcConnect(&SDCD1);
+	}
+	diskUnlock();
+	return err;
+}
+
+/*
+ * The pending erase ranges are dropped, they would hit the next card.
+ */
+void diskDisconnect(void) {
+	diskLock();
+	diskTrimCount = 0;
+	sdcDisconnect(&SDCD1);
+	diskUnlock();
+}
+
+/*
+ * Drop the pending erase ranges touched by a write, the lock is held.
+ */
+static void disk_trim_cancel(uint32_t sector, uint32_t n) {
+	uint32_t i = 0;
+
+	while (i < diskTrimCount) {
+		if (sector <= diskTrims[i].end && sector + n - 1 >= diskTrims[i].start) {
+			diskTrims[i] = diskTrims[--diskTrimCount];
+			diskStats.trimsdropped++;
+		} else {
+			i++;
+		}
+	}
+}
+
+/*
+ * Account the driver error flags of a failed transfer.
+ */
+static void disk_count_errors(void) {
+	sdcflags_t flags = sdcGetAndClearErrors(&SDCD1);
+
+	if (flags & (SDC_CMD_CRC_ERROR | SDC_DATA_CRC_ERROR)) {
+		diskStats.crcerrors++;
+	}
+	if (flags & (SDC_COMMAND_TIMEOUT | SDC_DATA_TIMEOUT)) {
+		diskStats.timeouts++;
+	}
+	if (flags & (SDC_TX_UNDERRUN | SDC_RX_OVERRUN)) {
+		diskStats.overruns++;
+	}
+	if (!(flags & (SDC_CMD_CRC_ERROR | SDC_DATA_CRC_ERROR | SDC_COMMAND_TIMEOUT |
+			SDC_DATA_TIMEOUT | SDC_TX_UNDERRUN | SDC_RX_OVERRUN))) {
+		diskStats.othererrors++;
+	}
+}
+
+static bool_t disk_trim_queue(uint32_t start, uint32_t end) {
+	diskLock();
+	if (diskTrimCount >= DISK_TRIM_QUEUE) {
+		diskStats.trimsdropped++;
+		diskUnlock();
+		return CH_FAILED;
+	}
+	diskTrims[diskTrimCount].start = start;
+	diskTrims[diskTrimCount].end = end;
+	diskTrimCount++;
+	diskStats.trimsqueued++;
+	diskUnlock();
+	chBSemSignal(&diskTrimSem);
+	return CH_SUCCESS;
+}
+
+/*
+ * Sectors erased per lock hold: what the card advertises to erase within
+ * DISK_TRIM_BUDGET_MS, the erase timeout covers one AU, rounded down to
+ * whole erase blocks and one erase block at least.
+ */
+static uint32_t disk_trim_chunk(void) {
+	const SDCardInfo *info = sdcardGetInfo();
+	uint32_t chunk, n;
+
+	chunk = info->eraseblk > 0 ? info->eraseblk : DISK_TRIM_CHUNK;
+	if (info->ausize > 0 && info->erasetimeout > 0) {
+		n = info->ausize * DISK_TRIM_BUDGET_MS / info->erasetimeout;
+		if (n > chunk) {
+			chunk = n - n % chunk;
+		}
+	}
+	return chunk;
+}
+
+/*
+ * Sleeps until no transfer happened for DISK_TRIM_IDLE_MS.
+ */
+static void disk_trim_wait_idle(void) {
+	systime_t quiet;
+
+	while ((quiet = chTimeNow() - diskLastTransfer) < MS2ST(DISK_TRIM_IDLE_MS)) {
+		chThdSleep(MS2ST(DISK_TRIM_IDLE_MS) - quiet);
+	}
+}
+
+/*
+ * Erases the queued ranges while the card is idle, a chunk per lock hold
+ * so that a writer arriving meanwhile waits for one short erase at most.
+ */
+static CCM_DATA WORKING_AREA(diskTrimThreadWA, 1024);
+static msg_t diskTrimThread(void *arg) {
+	uint32_t start, end, chunk;
+
+	(void)arg;
+	chRegSetThreadName("Trim");
+	while (TRUE) {
+		chBSemWait(&diskTrimSem);
+		while (TRUE) {
+			disk_trim_wait_idle();
+			diskLock();
+			if (diskTrimCount == 0) {
+				diskUnlock();
+				break;
+			}
+			chunk = disk_trim_chunk();
+			start = diskTrims[0].start;
+			end = diskTrims[0].end;
+			if (end - start + 1 > chunk) {
+				end = start + chunk - 1;
+				diskTrims[0].start = end + 1;
+			} else {
+				diskTrims[0] = diskTrims[--diskTrimCount];
+			}
+			if (blkGetDriverState(&SDCD1) == BLK_READY) {
+				if (sdcErase(&SDCD1, start, end)) {
+					/* Only a hint, not retried.*/
+					disk_count_errors();
+				} else {
+					diskStats.trimmed += end - start + 1;
+				}
+			}
+			diskUnlock();
+		}
+	}
+	return (msg_t)NULL;
+}
+
+void diskInit(void) {
+	ramdiskInit();
+	chThdCreateStatic(diskTrimThreadWA, sizeof(diskTrimThreadWA),
+			LOWPRIO + 1, diskTrimThread, NULL);
+}
+
+const DiskStats *diskGetStats(void) {
+	return &diskStats;
+}
+
+/*
+ * One transfer with the recovery ladder, the lock is held. The card is
+ * left disconnected if it cannot be reset, FatFs then reports not ready
+ * until the next mount.
+ */
+METRIC_HISTOGRAM(diskReadTime, "disk.read_us", "us");
+METRIC_HISTOGRAM(diskWriteTime, "disk.write_us", "us");
+METRIC_COUNTER(diskReadBytes, "disk.read_bytes", "B");
+METRIC_COUNTER(diskWriteBytes, "disk.write_bytes", "B");
+
+static bool_t disk_transfer(bool_t write, uint32_t sector, uint8_t *buf, uint32_t n) {
+	uint32_t attempt;
+	bool_t err;
+	halrtcnt_t start;
+
+	for (attempt = 0; ; attempt++) {
+		start = halGetCounterValue();
+		if (write) {
+			if (n >= DISK_PREERASE_MIN && !sdcardSetEraseCount(&SDCD1, n)) {
+				diskStats.preerases++;
+			}
+			TRACE(TRACE_EV_SDIO_WRITE, n, sector);
+			err = sdcWrite(&SDCD1, sector, buf, n);
+		} else {
+			TRACE(TRACE_EV_SDIO_READ, n, sector);
+			err = sdcRead(&SDCD1, sector, buf, n);
+		}
+		TRACE(TRACE_EV_SDIO_END, err, sector);
+		metricObserve(write ? &diskWriteTime : &diskReadTime,
+			(halGetCounterValue() - start) / (halGetCounterFrequency() / 1000000));
+		if (!err) {
+			metricAdd(write ? &diskWriteBytes : &diskReadBytes, n * MMCSD_BLOCK_SIZE);
+			if (attempt > 0) {
+				diskStats.recovered++;
+			}
+			return CH_SUCCESS;
+		}
+		disk_count_errors();
+		if (attempt >= DISK_RETRIES) {
+			break;
+		}
+		diskStats.retries++;
+		chThdSleepMilliseconds(DISK_RETRY_BACKOFF_MS << attempt);
+		if (attempt > 0) {
+			diskStats.reinits++;
+			if (sdcardRecover(&SDCD1, attempt + 1 >= DISK_RETRIES)) {
+				break;
+			}
+		}
+	}
+	diskStats.failed++;
+	return CH_FAILED;
+}
+
+/*
+ * Raw block access shared by FatFs and the raw log.
+ */
+bool_t diskRead(uint32_t sector, uint8_t *buf, uint32_t n) {
+	bool_t err;
+
+	diskLock();
+	err = disk_transfer(FALSE, sector, buf, n);
+	diskLastTransfer = chTimeNow();
+	diskStats.reads++;
+	if (!err) {
+		diskStats.rsectors += n;
+	}
+	diskUnlock();
+	return err;
+}
+
+bool_t diskWrite(uint32_t sector, const uint8_t *buf, uint32_t n) {
+	bool_t err;
+
+	diskLock();
+	disk_trim_cancel(sector, n);
+	err = disk_transfer(TRUE, sector, (uint8_t *)buf, n);
+	diskLastTransfer = chTimeNow();
+	diskStats.writes++;
+	if (!err) {
+		diskStats.wsectors += n;
+	}
+	diskUnlock();
+	return err;
+}
+
+/*
+ * Erase a range right away, for regions about to be streamed to.
+ */
+bool_t diskErase(uint32_t start, uint32_t end) {
+	bool_t err;
+
+	diskLock();
+	disk_trim_cancel(start, end - start + 1);
+	err = sdcErase(&SDCD1, start, end);
+	if (!err) {
+		diskStats.trimmed += end - start + 1;
+	}
+	diskUnlock();
+	return err;
+}
+
+static DSTATUS disk_sdc_status(void) {
+	DSTATUS stat = 0;
+
+	if (blkGetDriverState(&SDCD1) != BLK_READY) {
+		stat |= STA_NOINIT;
+	}
+	if (sdcIsWriteProtected(&SDCD1)) {
+		stat |= STA_PROTECT;
+	}
+	return stat;
+}
+
+DSTATUS disk_initialize(BYTE drv) {
+	switch (drv) {
+	case SDC:
+		/* It is initialized externally, just reads the status.*/
+		return disk_sdc_status();
+	case RAM:
+		return 0;
+	}
+	return STA_NODISK;
+}
+
+DSTATUS disk_status(BYTE drv) {
+	switch (drv) {
+	case SDC:
+		return disk_sdc_status();
+	case RAM:
+		return 0;
+	}
+	return STA_NODISK;
+}
+
+DRESULT disk_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count) {
+	switch (drv) {
+	case SDC:
+		if (blkGetDriverState(&SDCD1) != BLK_READY) {
+			return RES_NOTRDY;
+		}
+		return diskRead(sector, buff, count) ? RES_ERROR : RES_OK;
+	case RAM:
+		return ramdiskRead(buff, sector, count);
+	}
+	return RES_PARERR;
+}
+
+#if _FS_READONLY == 0
+DRESULT disk_write(BYTE drv, const BYTE *buff, DWORD sector, BYTE count) {
+	switch (drv) {
+	case SDC:
+		if (blkGetDriverState(&SDCD1) != BLK_READY) {
+			return RES_NOTRDY;
+		}
+		if (sdcIsWriteProtected(&SDCD1)) {
+			return RES_WRPRT;
+		}
+		return diskWrite(sector, buff, count) ? RES_ERROR : RES_OK;
+	case RAM:
+		return ramdiskWrite(buff, sector, count);
+	}
+	return RES_PARERR;
+}
+#endif /* _FS_READONLY == 0 */
+
+DRESULT disk_ioctl(BYTE drv, BYTE ctrl, void *buff) {
+	switch (drv) {
+	case SDC:
+		switch (ctrl) {
+		case CTRL_SYNC:
+			return RES_OK;
+		case GET_SECTOR_COUNT:
+			*((DWORD *)buff) = mmcsdGetCardCapacity(&SDCD1);
+			return RES_OK;
+		case GET_SECTOR_SIZE:
+			*((WORD *)buff) = MMCSD_BLOCK_SIZE;
+			return RES_OK;
+		case GET_BLOCK_SIZE:
+			/*
+			 * f_mkfs() aligns the data area to this many sectors, it
+			 * ignores values above DISK_ALIGN_MAX.
+			 */
+			*((DWORD *)buff) = sdcardBlockSize() > DISK_ALIGN_MAX ?
+				DISK_ALIGN_MAX : sdcardBlockSize();
+			return RES_OK;
+#if _USE_ERASE
+		case CTRL_ERASE_SECTOR:
+			/*
+			 * Freed cluster run, erased in background.
+			 */
+			disk_trim_queue(((DWORD *)buff)[0], ((DWORD *)buff)[1]);
+			return RES_OK;
+#endif
+		default:
+			return RES_PARERR;
+		}
+	case RAM:
+		switch (ctrl) {
+		case CTRL_SYNC:
+			return RES_OK;
+		case GET_SECTOR_COUNT:
+			*((DWORD *)buff) = RAMDISK_SECTORS;
+			return RES_OK;
+		case GET_SECTOR_SIZE:
+			*((WORD *)buff) = MMCSD_BLOCK_SIZE;
+			return RES_OK;
+		case GET_BLOCK_SIZE:
+			*((DWORD *)buff) = 1;
+			return RES_OK;
+#if _USE_ERASE
+		case CTRL_ERASE_SECTOR:
+			ramdiskTrim(((DWORD *)buff)[0], ((DWORD *)buff)[1]);
+			return RES_OK;
+#endif
+		default:
+			return RES_PARERR;
+		}
+	}
+	return RES_PARERR;
+}
+
+DWORD get_fattime(void) {
+#if HAL_USE_RTC
+	return rtcGetTimeFat(&RTCD1);
+#else
+	return ((uint32_t)0 | (1 << 16)) | (1 << 21); /* wrong but valid time */
+#endif
+}
+
+void cmd_diskstat(BaseSequentialStream *chp, int argc, char *argv[]) {
+	(void)argv;
+	if (argc > 0) {
+		chprintf(chp, "Usage: diskstat\r\n");
+		chprintf(chp, "       Prints the SD disk layer counters\r\n");
+		return;
+	}
+	chprintf(chp, "reads      : %lu, %lu sectors\r\n", diskStats.reads, diskStats.rsectors);
+	chprintf(chp, "writes     : %lu, %lu sectors\r\n", diskStats.writes, diskStats.wsectors);
+	chprintf(chp, "pre-erases : %lu\r\n", diskStats.preerases);
+	chprintf(chp, "trims      : %lu queued, %lu dropped, %lu pending, %lu sectors erased\r\n",
+		diskStats.trimsqueued, diskStats.trimsdropped, diskTrimCount, diskStats.trimmed);
+	chprintf(chp, "errors     : %lu CRC, %lu timeout, %lu overrun, %lu other\r\n",
+		diskStats.crcerrors, diskStats.timeouts, diskStats.overruns, diskStats.othererrors);
+	chprintf(chp, "recovery   : %lu retries, %lu card resets, %lu recovered, %lu failed\r\n",
+		diskStats.retries, diskStats.reinits, diskStats.recovered, diskStats.failed);
+}
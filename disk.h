@@ -0,0 +1,102 @@
+/*
+ * disk.h
+ *
+ *  FatFs disk I/O layer for the SDC driver and the RAM disk.
+ */
+
+#ifndef DISK_H_
+#define DISK_H_
+
+/**
+ * @brief   Smallest multi-block write announced to the card with ACMD23.
+ */
+#if !defined(DISK_PREERASE_MIN)
+#define DISK_PREERASE_MIN       2
+#endif
+
+/**
+ * @brief   Largest data area alignment f_mkfs() applies, in sectors,
+ *          GET_BLOCK_SIZE reports the AU capped to it.
+ */
+#define DISK_ALIGN_MAX          32768
+
+/**
+ * @brief   Number of freed ranges waiting for the background erase.
+ */
+#if !defined(DISK_TRIM_QUEUE)
+#define DISK_TRIM_QUEUE         8
+#endif
+
+/**
+ * @brief   Sectors erased per lock hold when the card does not report its
+ *          erase block.
+ */
+#if !defined(DISK_TRIM_CHUNK)
+#define DISK_TRIM_CHUNK         128
+#endif
+
+/**
+ * @brief   Erase time the writers may wait for, per lock hold.
+ * @details Sized from the card erase timeout, one erase block at least.
+ */
+#if !defined(DISK_TRIM_BUDGET_MS)
+#define DISK_TRIM_BUDGET_MS     5
+#endif
+
+/**
+ * @brief   Time without transfers before the background erase runs.
+ */
+#if !defined(DISK_TRIM_IDLE_MS)
+#define DISK_TRIM_IDLE_MS       500
+#endif
+
+/**
+ * @brief   Attempts of a failed transfer before FatFs sees the error.
+ * @details The first retry only waits, the next ones reset the card, the
+ *          last one also lowers the bus clock.
+ */
+#if !defined(DISK_RETRIES)
+#define DISK_RETRIES            3
+#endif
+
+/**
+ * @brief   Wait before the first retry, doubled on each attempt.
+ */
+#if !defined(DISK_RETRY_BACKOFF_MS)
+#define DISK_RETRY_BACKOFF_MS   10
+#endif
+
+/**
+ * @brief   Disk layer counters.
+ */
+typedef struct {
+  uint32_t reads;
+  uint32_t rsectors;
+  uint32_t writes;
+  uint32_t wsectors;
+  uint32_t preerases;       /* ACMD23 hints accepted by the card.           */
+  uint32_t trimsqueued;
+  uint32_t trimsdropped;    /* Hints lost to a full queue or a rewrite.     */
+  uint32_t trimmed;         /* Sectors erased.                              */
+  uint32_t crcerrors;       /* Command or data CRC failures.                */
+  uint32_t timeouts;        /* Command or data timeouts.                    */
+  uint32_t overruns;        /* FIFO under/overruns.                         */
+  uint32_t othererrors;     /* Start bit and other failures.                */
+  uint32_t retries;
+  uint32_t reinits;         /* Card resets done by the recovery.            */
+  uint32_t recovered;       /* Transfers that succeeded after a retry.      */
+  uint32_t failed;          /* Transfers given up, FR_DISK_ERR to FatFs.    */
+} DiskStats;
+
+void diskInit(void);
+void diskLock(void);
+void diskUnlock(void);
+bool_t diskConnect(void);
+void diskDisconnect(void);
+bool_t diskRead(uint32_t sector, uint8_t *buf, uint32_t n);
+bool_t diskWrite(uint32_t sector, const uint8_t *buf, uint32_t n);
+bool_t diskErase(uint32_t start, uint32_t end);
+const DiskStats *diskGetStats(void);
+void cmd_diskstat(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* DISK_H_ */
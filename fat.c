@@ -20,12 +20,201 @@
 #include "shell.h"
 
 #include "fat.h"
+#include "sdcard.h"
+#include "disk.h"
+#include "ramdisk.h"
+#include "rawlog.h"
+#include "fwriter.h"
+#include "fspool.h"
+#include "memmap.h"
+#include "metrics.h"
+#include "command.h"
+#include "jobs.h"
 
 #include "ff.h"
 
 /* Generic large buffer.*/
-static char fbuff[1024];
+static CCM_DATA char fbuff[1024];
+/* Buffer for the buffered file writers, SDIO DMA.*/
+static uint8_t wbuff[FW_BUFFER_SIZE];
+/* Held by the command using fbuff or wbuff, a job may have them.*/
+static MUTEX_DECL(fatBufMtx);
 static FATFS SDC_FS;
+/* Its window is only copied to by the CPU.*/
+static CCM_DATA FATFS RAM_FS;
+
+/*
+ * Mount state, changes are broadcast on fatCond.
+ */
+static MUTEX_DECL(fatMtx);
+static CONDVAR_DECL(fatCond);
+static fatstate_t fatState;
+static FRESULT fatResult = FR_NOT_READY;
+static systime_t fatReadyTime;
+static BSEMAPHORE_DECL(fatMountSem, TRUE);
+
+METRIC_COUNTER(fatMounts, "fat.mounts", "");
+METRIC_COUNTER(fatMountFailures, "fat.mount_failures", "");
+METRIC_GAUGE(fatMountTime, "fat.mount_ms", "ms");
+
+static void fat_set_state(fatstate_t state, FRESULT result) {
+	chMtxLock(&fatMtx);
+	fatState = state;
+	fatResult = result;
+	chCondBroadcast(&fatCond);
+	chMtxUnlock();
+}
+
+/*
+ * Connect the card, register the volume and load the boot sector and FAT
+ * geometry and the free cluster count (a full FAT scan without FSInfo),
+ * which FatFs keeps for the following calls. The volume stays registered
+ * without a file system so that mkfs works.
+ */
+static FRESULT fat_mount(void) {
+	FRESULT err;
+	DWORD clusters;
+	FATFS *fsp;
+
+	if (diskConnect()) {
+		return FR_NOT_READY;
+	}
+	sdcardProbe(&SDCD1);
+	err = f_mount(0, &SDC_FS);
+	if (err != FR_OK) {
+		return err;
+	}
+	return f_getfree("/", &clusters, &fsp);
+}
+
+/*
+ * Mounts in background so that boot is not held by the card
+ * initialization, fatMount() requests a new attempt.
+ */
+static CCM_DATA WORKING_AREA(fatMountThreadWA, 1024);
+static msg_t fatMountThread(void *arg) {
+	FRESULT err;
+	systime_t start;
+
+	(void)arg;
+	chRegSetThreadName("Mount");
+	while (TRUE) {
+		chBSemWait(&fatMountSem);
+		start = chTimeNow();
+		err = fat_mount();
+		if (err == FR_OK) {
+			palSetPad(GPIOD, GPIOD_LED6);
+			fatReadyTime = chTimeNow();
+			bootMark(BOOT_SD_MOUNTED);
+			metricInc(fatMounts);
+			metricSet(fatMountTime, (fatReadyTime - start) * 1000 / CH_FREQUENCY);
+		} else {
+			metricInc(fatMountFailures);
+		}
+		fat_set_state(err == FR_OK ? FAT_READY : FAT_FAILED, err);
+	}
+	return (msg_t)NULL;
+}
+
+void fatInit(void) {
+	memAssertDma(wbuff);
+	memAssertDma(SDC_FS.win);
+	/* Registration only, the RAM disk reads empty until mkfs 1.*/
+	f_mount(RAMDISK_DRIVE, &RAM_FS);
+	chThdCreateStatic(fatMountThreadWA, sizeof(fatMountThreadWA),
+			NORMALPRIO - 1, fatMountThread, NULL);
+	fatMount();
+}
+
+void fatMount(void) {
+	chMtxLock(&fatMtx);
+	if (fatState == FAT_MOUNTING || fatState == FAT_READY) {
+		chMtxUnlock();
+		return;
+	}
+	fatState = FAT_MOUNTING;
+	chMtxUnlock();
+	chBSemSignal(&fatMountSem);
+}
+
+/*
+ * Files open on the volumes: pool objects in use, log writers, the raw
+ * log. f_mkfs() would write the new volume under them.
+ */
+static bool_t fat_files_open(void) {
+	const FsPoolStats *ps;
+	uint32_t i;
+
+	if (rawlogIsOpen() || fwOpenCount() > 0) {
+		return TRUE;
+	}
+	for (i = 0; (ps = fsPoolGetStats(i)) != NULL; i++) {
+		if (ps->used > 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Refused while files are open, their sectors would go to a disconnected
+ * or another card.
+ */
+bool_t fatUnmount(void) {
+	/* Lets a mount in progress finish first.*/
+	fatWaitReady(TIME_INFINITE);
+	if (fat_files_open()) {
+		return CH_FAILED;
+	}
+	/* New opens fail from here.*/
+	fat_set_state(FAT_UNMOUNTED, FR_NOT_READY);
+	palClearPad(GPIOD, GPIOD_LED6);
+	f_mount(0, NULL);
+	diskDisconnect();
+	return CH_SUCCESS;
+}
+
+/*
+ * Wait for the background mount to complete, returns its result or
+ * FR_TIMEOUT.
+ */
+FRESULT fatWaitReady(systime_t timeout) {
+	FRESULT err;
+
+	chMtxLock(&fatMtx);
+	while (fatState == FAT_MOUNTING) {
+		if (chCondWaitTimeout(&fatCond, timeout) == RDY_TIMEOUT) {
+			/* The mutex is not reacquired on timeout.*/
+			return FR_TIMEOUT;
+		}
+	}
+	err = fatResult;
+	chMtxUnlock();
+	return err;
+}
+
+fatstate_t fatGetState(void) {
+	return fatState;
+}
+
+/*
+ * Wait for the SD volume in a command, printing why it is not usable.
+ * Paths on the RAM disk do not wait.
+ */
+static bool_t fat_ready(BaseSequentialStream *chp, const char *path) {
+	FRESULT err;
+
+	if (path != NULL && path[0] == '0' + RAMDISK_DRIVE && path[1] == ':') {
+		return TRUE;
+	}
+	err = fatWaitReady(MS2ST(FAT_READY_TIMEOUT_MS));
+	if (err != FR_OK) {
+		chprintf(chp, "FS: volume not ready. Is the SD card inserted?\r\n");
+		verbose_error(chp, err);
+		return FALSE;
+	}
+	return TRUE;
+}
 
 /*
  * Scan Files in a path and print them to the character stream.
@@ -33,7 +222,7 @@ static FATFS SDC_FS;
 FRESULT scan_files(BaseSequentialStream *chp, char *path) {
 	FRESULT res;
 	FILINFO fno;
-	DIR dir;
+	DIR *dir;
 	int fyear,fmonth,fday,fhour,fminute,fsecond;
 
 	int i;
@@ -47,17 +236,30 @@ FRESULT scan_files(BaseSequentialStream *chp, char *path) {
 	 * Open the Directory.
 	 */
   chprintf(chp, "path: %s\r\n", path);
-	res = f_opendir(&dir, path);
+	/*
+	 * One directory object per level, from the pool.
+	 */
+	dir = fsDirAlloc();
+	if (dir == NULL) {
+		chprintf(chp, "FS: too deep, no free directory object\r\n");
+		return FR_NOT_ENOUGH_CORE;
+	}
+	res = f_opendir(dir, path);
 	if (res == FR_OK) {
 		/*
 		 * If the path opened successfully.
 		 */
 		i = strlen(path);
 		while (true) {
+			if (jobCancelled()) {
+				chprintf(chp, "FS: cancelled\r\n");
+				res = FR_DENIED;
+				break;
+			}
 			/*
 			 * Read the Directory.
 			 */
-			res = f_readdir(&dir, &fno);
+			res = f_readdir(dir, &fno);
 			/*
 			 * If the directory read failed or the
 			 */
@@ -118,6 +320,7 @@ FRESULT scan_files(BaseSequentialStream *chp, char *path) {
 	} else {
 		chprintf(chp, "FS: f_opendir() failed\r\n");
 	}
+	fsDirFree(dir);
 	return res;
 }
 
@@ -126,65 +329,142 @@ void cmd_mount(BaseSequentialStream *chp, int argc, char *argv[]) {
 	(void)argc;
 	(void)argv;
 	/*
-	 * Attempt to mount the drive.
+	 * The volume is mounted at boot, this retries after an unmount or a
+	 * failed attempt.
 	 */
-	err = f_mount(0, &SDC_FS);
+	fatMount();
+	err = fatWaitReady(MS2ST(FAT_READY_TIMEOUT_MS));
 	if (err != FR_OK) {
-		chprintf(chp, "FS: f_mount() failed. Is the SD card inserted?\r\n");
+		chprintf(chp, "FS: mount failed. Is the SD card inserted?\r\n");
 		verbose_error(chp, err);
 		return;
 	}
-	chprintf(chp, "FS: 1 f_mount() succeeded\r\n");
-	palSetPad(GPIOD, GPIOD_LED6);
-	chprintf(chp, "FS: 2 f_mount() succeeded\r\n");
-	sdcConnect(&SDCD1);
-	chprintf(chp, "FS: 3 f_mount() succeeded\r\n");
+	chprintf(chp, "FS: mounted %lu ms after boot\r\n",
+		(uint32_t)fatReadyTime * 1000 / CH_FREQUENCY);
 }
 
-void cmd_mkfs(BaseSequentialStream *chp, int argc, char *argv[]) {
+/*
+ * Print the layout of the mounted volume against the card allocation unit.
+ */
+static void print_geometry(BaseSequentialStream *chp) {
+	FRESULT err;
+	uint32_t clusters, au;
+	FATFS *fsp;
+	static const char *types[] = {"?", "FAT12", "FAT16", "FAT32"};
+
+	err = f_getfree("/", &clusters, &fsp);
+	if (err != FR_OK) {
+		chprintf(chp, "FS: f_getfree() failed\r\n");
+		verbose_error(chp, err);
+		return;
+	}
+	/* The alignment f_mkfs() applies, GET_BLOCK_SIZE caps it.*/
+	au = sdcardBlockSize() > DISK_ALIGN_MAX ? DISK_ALIGN_MAX : sdcardBlockSize();
+	chprintf(chp, "FS: %s, %lu clusters of %lu B\r\n",
+		types[fsp->fs_type <= FS_FAT32 ? fsp->fs_type : 0],
+		(uint32_t)fsp->n_fatent - 2, (uint32_t)fsp->csize * MMCSD_BLOCK_SIZE);
+	chprintf(chp, "    volume at %lu, FAT at %lu, data at %lu\r\n",
+		(uint32_t)fsp->volbase, (uint32_t)fsp->fatbase, (uint32_t)fsp->database);
+	chprintf(chp, "    AU %lu sectors, data area %saligned%s\r\n",
+		sdcardBlockSize(), (fsp->database % au) ? "NOT " : "",
+		au < sdcardBlockSize() ? " to the FatFs limit of 32768 sectors" : "");
+}
+
+/*
+ * Refused while files are open. The volume reads as mounting meanwhile so
+ * that new opens wait for the format to end.
+ */
+static void fat_mkfs(BaseSequentialStream *chp, int argc, char *argv[]) {
 	FRESULT err;
 	int partition;
-	if (argc!=1) {
-		chprintf(chp, "Usage: mkfs [partition]\r\n");
+	uint32_t rawsize, au;
+	if (argc < 1 || argc > 2) {
+		chprintf(chp, "Usage: mkfs [partition] [rawMB]\r\n");
 		chprintf(chp, "       Formats partition [partition]\r\n");
+		chprintf(chp, "       Reserves [rawMB] contiguous MB for %s\r\n", RAWLOG_FILENAME);
+		return;
+	}
+	if (fat_files_open()) {
+		chprintf(chp, "FS: files open, close the logs and wait for the jobs\r\n");
 		return;
 	}
 	partition=atoi(argv[0]);
-	chprintf(chp, "FS: f_mkfs(%d,0,0) Started\r\n",partition);
-	err = f_mkfs(partition, 0, 0);
+	if (partition == RAMDISK_DRIVE) {
+		/* No partition table, f_mkfs() picks the cluster size.*/
+		err = f_mkfs(partition, 1, 0);
+		if (err != FR_OK) {
+			chprintf(chp, "FS: f_mkfs() failed\r\n");
+			verbose_error(chp, err);
+			return;
+		}
+		chprintf(chp, "FS: RAM disk formatted, %u sectors\r\n", RAMDISK_SECTORS);
+		return;
+	}
+	/* A blank card fails the mount but stays connected.*/
+	fatWaitReady(MS2ST(FAT_READY_TIMEOUT_MS));
+	if (blkGetDriverState(&SDCD1) != BLK_READY) {
+		chprintf(chp, "SD: no card connected, use mount\r\n");
+		return;
+	}
+	rawsize = (argc > 1) ? (uint32_t)atoi(argv[1]) * 1024 * 1024 : 0;
+	/*
+	 * Cluster size advised for the card, one AU capped to 32KiB.
+	 * f_mkfs() aligns the data area to the AU through GET_BLOCK_SIZE.
+	 */
+	au = sdcardGetInfo()->cluster;
+	chprintf(chp, "FS: f_mkfs(%d,0,%lu) Started\r\n",partition,au);
+	fat_set_state(FAT_MOUNTING, FR_OK);
+	err = f_mkfs(partition, 0, au);
 	if (err != FR_OK) {
+		fat_set_state(FAT_FAILED, err);
 		chprintf(chp, "FS: f_mkfs() failed\r\n");
 		verbose_error(chp, err);
 		return;
 	}
 	chprintf(chp, "FS: f_mkfs() Finished\r\n");
+	palSetPad(GPIOD, GPIOD_LED6);
+	fat_set_state(FAT_READY, FR_OK);
+	print_geometry(chp);
+	/*
+	 * Reserve the raw log region while the volume is still empty so that
+	 * its clusters are contiguous.
+	 */
+	if (rawsize > 0) {
+		err = rawlogReserve(rawsize);
+		if (err != FR_OK) {
+			chprintf(chp, "FS: rawlogReserve(%lu) failed\r\n", rawsize);
+			verbose_error(chp, err);
+			return;
+		}
+		chprintf(chp, "FS: %s reserved, %lu MB\r\n", RAWLOG_FILENAME, rawsize / (1024 * 1024));
+	}
 	return;
 }
 
 void cmd_unmount(BaseSequentialStream *chp, int argc, char *argv[]) {
-	FRESULT err;
 	(void)argc;
 	(void)argv;
 
-	palClearPad(GPIOD, GPIOD_LED6);
-	sdcDisconnect(&SDCD1);
-	err = f_mount(0, NULL);
-	if (err != FR_OK) {
-		chprintf(chp, "FS: f_mount() unmount failed\r\n");
-		verbose_error(chp, err);
-		return;
+	if (fatUnmount()) {
+		chprintf(chp, "FS: files open, close the logs and wait for the jobs\r\n");
 	}
-	return;
 }
 
 void cmd_free(BaseSequentialStream *chp, int argc, char *argv[]) {
 	FRESULT err;
-	uint32_t clusters;
+	uint32_t clusters, bytes;
 	FATFS *fsp;
-	(void)argc;
-	(void)argv;
+	const char *path = argc > 0 ? argv[0] : "/";
 
-	err = f_getfree("/", &clusters, &fsp);
+	if (argc > 1) {
+		chprintf(chp, "Usage: free [drive:]\r\n");
+		chprintf(chp, "       Prints the free space of [drive:] (default 0:)\r\n");
+		return;
+	}
+	if (!fat_ready(chp, path)) {
+		return;
+	}
+	err = f_getfree(path, &clusters, &fsp);
 	if (err != FR_OK) {
 		chprintf(chp, "FS: f_getfree() failed\r\n");
 		return;
@@ -192,30 +472,275 @@ void cmd_free(BaseSequentialStream *chp, int argc, char *argv[]) {
 	/*
 	 * Print the number of free clusters and size free in B, KiB and MiB.
 	 */
+	bytes = clusters * (uint32_t)fsp->csize * (uint32_t)MMCSD_BLOCK_SIZE;
 	chprintf(chp,"FS: %lu free clusters\r\n    %lu sectors per cluster\r\n",
-		clusters, (uint32_t)SDC_FS.csize);
-	chprintf(chp,"%lu B free\r\n",
-		clusters * (uint32_t)SDC_FS.csize * (uint32_t)MMCSD_BLOCK_SIZE);
-	chprintf(chp,"%lu KB free\r\n",
-		(clusters * (uint32_t)SDC_FS.csize * (uint32_t)MMCSD_BLOCK_SIZE)/(1024));
-	chprintf(chp,"%lu MB free\r\n",
-		(clusters * (uint32_t)SDC_FS.csize * (uint32_t)MMCSD_BLOCK_SIZE)/(1024*1024));
+		clusters, (uint32_t)fsp->csize);
+	chprintf(chp,"%lu B free\r\n", bytes);
+	chprintf(chp,"%lu KB free\r\n", bytes/(1024));
+	chprintf(chp,"%lu MB free\r\n", bytes/(1024*1024));
 }
 
-void cmd_tree(BaseSequentialStream *chp, int argc, char *argv[]) {
+/*
+ * Print the card identification, performance ratings, bus mode and the
+ * sizing derived from them. The benchmark and the probe use the card
+ * scratch buffer, like sdbench they hold the FatFs buffers lock.
+ */
+static void fat_sdinfo(BaseSequentialStream *chp, int argc, char *argv[]) {
+	const SDCardInfo *info = sdcardGetInfo();
+	if (argc > 1 || (argc == 1 && strcmp(argv[0], "probe"))) {
+		chprintf(chp, "Usage: sdinfo [probe]\r\n");
+		chprintf(chp, "       Prints the SD card registers, bus mode and throughput\r\n");
+		chprintf(chp, "       probe also times %u writes of 4KiB to %s\r\n",
+			SDCARD_PROBE_WRITES, SDCARD_PROBE_FILENAME);
+		return;
+	}
+	fatWaitReady(MS2ST(FAT_READY_TIMEOUT_MS));
+	if (blkGetDriverState(&SDCD1) != BLK_READY || !info->valid) {
+		chprintf(chp, "SD: no card connected, use mount\r\n");
+		return;
+	}
+	sdcardBenchmark();
+	if (argc == 1 && sdcardLatencyProbe()) {
+		chprintf(chp, "SD: write latency probe failed\r\n");
+	}
+	chprintf(chp, "card       : %s (0x%02x) %s %s rev %u.%u\r\n",
+		sdcardManufacturer(info->mid), info->mid, info->oid, info->pnm,
+		info->prv >> 4, info->prv & 0xF);
+	chprintf(chp, "serial     : %08lx, made %u/%02u\r\n",
+		info->psn, info->year, info->month);
+	chprintf(chp, "capacity   : %lu sectors, %lu MB, CSD v%lu\r\n",
+		info->capacity, info->capacity / 2048, info->csdversion);
+	chprintf(chp, "spec       : %lu.%02lu, CMD23 %s\r\n",
+		info->spec / 100, info->spec % 100, info->cmd23 ? "yes" : "no");
+	chprintf(chp, "class      : C%lu, U%lu, V%lu\r\n",
+		info->speedclass, info->uhsgrade, info->videoclass);
+	chprintf(chp, "bus        : %lu bit, %lu kHz, %s\r\n",
+		info->buswidth, info->clock / 1000,
+		info->highspeed ? "High Speed" :
+		(info->hscapable ? "Default Speed (High Speed switch failed)" : "Default Speed"));
+	chprintf(chp, "fallbacks  : %lu clock steps\r\n", info->fallbacks);
+	chprintf(chp, "read       : %lu KiB/s\r\n", info->throughput);
+	chprintf(chp, "AU         : %lu sectors, erase %lu ms\r\n",
+		info->ausize, info->erasetimeout);
+	chprintf(chp, "erase      : %lu sectors\r\n", info->eraseblk);
+	if (info->wlatmax > 0) {
+		chprintf(chp, "write 4KiB : %lu us min, %lu us avg, %lu us max\r\n",
+			info->wlatmin, info->wlatavg, info->wlatmax);
+	} else {
+		chprintf(chp, "write 4KiB : not measured, use sdinfo probe\r\n");
+	}
+	chprintf(chp, "advice     : cluster %lu B, prealloc %lu KiB, buffer %lu KiB\r\n",
+		info->cluster, info->prealloc / 1024, (info->bufbytes + 1023) / 1024);
+}
+
+/*
+ * Sequential write then read of a test file.
+ */
+static void fat_sdbench(BaseSequentialStream *chp, int argc, char *argv[]) {
+	FIL *fil;
+	FRESULT err;
+	UINT n;
+	uint32_t i, chunks, kib, ms;
+	systime_t start;
+	if (argc > 1) {
+		chprintf(chp, "Usage: sdbench [MB]\r\n");
+		chprintf(chp, "       Writes and reads back [MB] (default 4) sequentially\r\n");
+		return;
+	}
+	kib = (argc > 0 ? (uint32_t)atoi(argv[0]) : 4) * 1024;
+	chunks = kib * 1024 / sizeof(wbuff);
+	for (i = 0; i < sizeof(wbuff); i++) {
+		wbuff[i] = (uint8_t)i;
+	}
+	if (!fat_ready(chp, NULL)) {
+		return;
+	}
+	fil = fsFileAlloc();
+	if (fil == NULL) {
+		chprintf(chp, "FS: no free file object\r\n");
+		return;
+	}
+	err = f_open(fil, "SDBENCH.BIN", FA_WRITE | FA_READ | FA_CREATE_ALWAYS);
+	if (err != FR_OK) {
+		chprintf(chp, "FS: f_open(\"SDBENCH.BIN\") failed.\r\n");
+		verbose_error(chp, err);
+		fsFileFree(fil);
+		return;
+	}
+	start = chTimeNow();
+	for (i = 0; i < chunks && err == FR_OK && !jobCancelled(); i++) {
+		err = f_write(fil, wbuff, sizeof(wbuff), &n);
+	}
+	if (err == FR_OK) {
+		err = f_sync(fil);
+	}
+	ms = (uint32_t)(chTimeNow() - start) * 1000 / CH_FREQUENCY + 1;
+	if (err == FR_OK && i < chunks) {
+		chprintf(chp, "FS: cancelled\r\n");
+		f_close(fil);
+		fsFileFree(fil);
+		f_unlink("SDBENCH.BIN");
+		return;
+	}
+	if (err != FR_OK) {
+		chprintf(chp, "FS: f_write() failed\r\n");
+		verbose_error(chp, err);
+		f_close(fil);
+		fsFileFree(fil);
+		return;
+	}
+	chprintf(chp, "write: %lu KiB in %lu ms, %lu KiB/s, %lu B writes\r\n",
+		kib, ms, kib * 1000 / ms, (uint32_t)sizeof(wbuff));
+	f_lseek(fil, 0);
+	start = chTimeNow();
+	for (i = 0; i < chunks && err == FR_OK && !jobCancelled(); i++) {
+		err = f_read(fil, wbuff, sizeof(wbuff), &n);
+	}
+	ms = (uint32_t)(chTimeNow() - start) * 1000 / CH_FREQUENCY + 1;
+	f_close(fil);
+	fsFileFree(fil);
+	f_unlink("SDBENCH.BIN");
+	if (err == FR_OK && i < chunks) {
+		chprintf(chp, "FS: cancelled\r\n");
+		return;
+	}
+	if (err != FR_OK) {
+		chprintf(chp, "FS: f_read() failed\r\n");
+		verbose_error(chp, err);
+		return;
+	}
+	chprintf(chp, "read:  %lu KiB in %lu ms, %lu KiB/s\r\n",
+		kib, ms, kib * 1000 / ms);
+	print_geometry(chp);
+}
+
+/*
+ * Copy a file in large sequential chunks, typically a burst staged on the
+ * RAM disk to the SD card.
+ */
+static void fat_cp(BaseSequentialStream *chp, int argc, char *argv[]) {
+	FIL *src, *dst;
+	FRESULT err;
+	UINT n, written;
+	uint32_t bytes = 0, ms;
+	systime_t start;
+	if (argc != 2) {
+		chprintf(chp, "Usage: cp src dst\r\n");
+		chprintf(chp, "       Copies src to dst, 1:name is on the RAM disk\r\n");
+		return;
+	}
+	if (!fat_ready(chp, argv[0]) || !fat_ready(chp, argv[1])) {
+		return;
+	}
+	src = fsFileAlloc();
+	dst = fsFileAlloc();
+	if (src == NULL || dst == NULL) {
+		chprintf(chp, "FS: no free file object\r\n");
+		if (src != NULL) {
+			fsFileFree(src);
+		}
+		if (dst != NULL) {
+			fsFileFree(dst);
+		}
+		return;
+	}
+	err = f_open(src, argv[0], FA_READ);
+	if (err != FR_OK) {
+		chprintf(chp, "FS: f_open(%s) failed.\r\n", argv[0]);
+		verbose_error(chp, err);
+		fsFileFree(src);
+		fsFileFree(dst);
+		return;
+	}
+	err = f_open(dst, argv[1], FA_WRITE | FA_CREATE_ALWAYS);
+	if (err != FR_OK) {
+		chprintf(chp, "FS: f_open(%s) failed.\r\n", argv[1]);
+		verbose_error(chp, err);
+		f_close(src);
+		fsFileFree(src);
+		fsFileFree(dst);
+		return;
+	}
+	/* Reserve the clusters so that the copy is one sequential stream.*/
+	err = f_lseek(dst, f_size(src));
+	if (err == FR_OK) {
+		err = f_lseek(dst, 0);
+	}
+	start = chTimeNow();
+	while (err == FR_OK) {
+		if (jobCancelled()) {
+			chprintf(chp, "FS: cancelled\r\n");
+			err = FR_DENIED;
+			break;
+		}
+		err = f_read(src, wbuff, sizeof(wbuff), &n);
+		if (err != FR_OK || n == 0) {
+			break;
+		}
+		err = f_write(dst, wbuff, n, &written);
+		if (err == FR_OK && written != n) {
+			err = FR_DENIED;
+		}
+		bytes += written;
+	}
+	if (err == FR_OK) {
+		err = f_truncate(dst);
+	}
+	f_close(src);
+	if (err == FR_OK) {
+		err = f_close(dst);
+	} else {
+		f_close(dst);
+	}
+	fsFileFree(src);
+	fsFileFree(dst);
+	ms = (uint32_t)(chTimeNow() - start) * 1000 / CH_FREQUENCY + 1;
+	if (err != FR_OK) {
+		chprintf(chp, "FS: copy failed after %lu B\r\n", bytes);
+		verbose_error(chp, err);
+		return;
+	}
+	chprintf(chp, "FS: %lu B in %lu ms, %lu KiB/s\r\n",
+		bytes, ms, bytes / 1024 * 1000 / ms);
+}
+
+void cmd_ramdisk(BaseSequentialStream *chp, int argc, char *argv[]) {
+	const RamdiskStats *stats = ramdiskGetStats();
 	(void)argv;
-	(void)argc;
+	if (argc > 0) {
+		chprintf(chp, "Usage: ramdisk\r\n");
+		chprintf(chp, "       Prints the RAM disk (drive 1:) memory use\r\n");
+		return;
+	}
+	chprintf(chp, "volume     : %u sectors, %u sectors of memory\r\n",
+		RAMDISK_SECTORS, RAMDISK_SLOTS);
+	chprintf(chp, "used       : %lu sectors, %lu peak\r\n", stats->used, stats->peak);
+	chprintf(chp, "accesses   : %lu reads, %lu writes, %lu failed when full\r\n",
+		stats->reads, stats->writes, stats->full);
+}
+
+static void fat_tree(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if (argc > 1) {
+		chprintf(chp, "Usage: tree [drive:]\r\n");
+		chprintf(chp, "       Prints the files of [drive:] (default 0:)\r\n");
+		return;
+	}
+	if (!fat_ready(chp, argc > 0 ? argv[0] : NULL)) {
+		return;
+	}
 	/*
-	 * Set the file path buffer to 0
+	 * Set the file path buffer to 0, or to the drive prefix.
 	 */
 	memset(fbuff,0,sizeof(fbuff));
+	if (argc > 0) {
+		strncpy(fbuff, argv[0], 2);
+	}
 	scan_files(chp, fbuff);
 }
 
-void cmd_hello(BaseSequentialStream *chp, int argc, char *argv[]) {
-	FIL fsrc;   /* file object */
+static void fat_hello(BaseSequentialStream *chp, int argc, char *argv[]) {
+	static FileWriter fw;   /* buffered file object, shares wbuff */
 	FRESULT err;
-	int written;
 	(void)argv;
 	/*
 	 * Print the input arguments.
@@ -225,10 +750,14 @@ void cmd_hello(BaseSequentialStream *chp, int argc, char *argv[]) {
 		chprintf(chp, "       Creates hello.txt with 'Hello World'\r\n");
 		return;
 	}
+	if (!fat_ready(chp, NULL)) {
+		return;
+	}
 	/*
 	 * Open the text file
 	 */
-	err = f_open(&fsrc, "hello.txt", FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+	fwObjectInit(&fw, wbuff, sizeof(wbuff));
+	err = fwOpen(&fw, "hello.txt", FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
 	if (err != FR_OK) {
 		chprintf(chp, "FS: f_open(\"hello.txt\") failed.\r\n");
 		verbose_error(chp, err);
@@ -239,16 +768,25 @@ void cmd_hello(BaseSequentialStream *chp, int argc, char *argv[]) {
 	/*
 	 * Write text to the file.
 	 */
-	written = f_puts ("Hello World", &fsrc);
-	if (written == -1) {
+	err = fwPuts(&fw, "Hello World");
+	/*
+	 * Close the file, this flushes the buffered text.
+	 */
+	if (err == FR_OK) {
+		err = fwClose(&fw);
+	} else {
+		fwClose(&fw);
+	}
+	if (err != FR_OK) {
 		chprintf(chp, "FS: f_puts(\"Hello World\",\"hello.txt\") failed\r\n");
+		verbose_error(chp, err);
 	} else {
 		chprintf(chp, "FS: f_puts(\"Hello World\",\"hello.txt\") succeeded\r\n");
 	}
-	/*
-	 * Close the file
-	 */
-	f_close(&fsrc);
+	if (cmdGetDebug()) {
+		chprintf(chp, "FS: %lu B, %lu writes, %lu B average\r\n",
+			fw.stats.bytes, fw.stats.writes, fwAverageWrite(&fw));
+	}
 }
 
 void cmd_mkdir(BaseSequentialStream *chp, int argc, char *argv[]) {
@@ -258,6 +796,9 @@ void cmd_mkdir(BaseSequentialStream *chp, int argc, char *argv[]) {
 		chprintf(chp, "       Creates directory with dirName (no spaces)\r\n");
 		return;
 	}
+	if (!fat_ready(chp, argv[0])) {
+		return;
+	}
 	/*
 	 * Attempt to make the directory with the name given in argv[0]
 	 */
@@ -283,6 +824,9 @@ void cmd_setlabel(BaseSequentialStream *chp, int argc, char *argv[]) {
 		chprintf(chp, "       Sets FAT label (no spaces)\r\n");
 		return;
 	}
+	if (!fat_ready(chp, argv[0])) {
+		return;
+	}
 	/*
 	 * Attempt to set the label with the name given in argv[0].
 	 */
@@ -307,6 +851,9 @@ void cmd_getlabel(BaseSequentialStream *chp, int argc, char *argv[]) {
 		chprintf(chp, "       Gets and prints FAT label\r\n");
 		return;
 	}
+	if (!fat_ready(chp, NULL)) {
+		return;
+	}
 	memset(lbl,0,sizeof(lbl));
 	/*
 	 * Get volume label & serial of the default drive
@@ -331,7 +878,7 @@ void cmd_getlabel(BaseSequentialStream *chp, int argc, char *argv[]) {
  */
 void cmd_cat(BaseSequentialStream *chp, int argc, char *argv[]) {
 	FRESULT err;
-	FIL fsrc;   /* file object */
+	FIL *fsrc;   /* file object, from the pool */
 	char Buffer[255];
 	UINT ByteToRead=sizeof(Buffer);
 	UINT ByteRead;
@@ -343,13 +890,22 @@ void cmd_cat(BaseSequentialStream *chp, int argc, char *argv[]) {
 		chprintf(chp, "       Echos filename (no spaces)\r\n");
 		return;
 	}
+	if (!fat_ready(chp, argv[0])) {
+		return;
+	}
 	/*
 	 * Attempt to open the file, error out if it fails.
 	 */
-	err=f_open(&fsrc, argv[0], FA_READ);
+	fsrc = fsFileAlloc();
+	if (fsrc == NULL) {
+		chprintf(chp, "FS: no free file object\r\n");
+		return;
+	}
+	err=f_open(fsrc, argv[0], FA_READ);
 	if (err != FR_OK) {
 		chprintf(chp, "FS: f_open(%s) failed.\r\n",argv[0]);
 		verbose_error(chp, err);
+		fsFileFree(fsrc);
 		return;
 	}
 	/*
@@ -357,6 +913,10 @@ void cmd_cat(BaseSequentialStream *chp, int argc, char *argv[]) {
 	 * (the buffer is filled)
 	 */
 	do {
+		if (jobCancelled()) {
+			chprintf(chp, "\r\nFS: cancelled\r\n");
+			break;
+		}
 		/*
 		 * Clear the buffer.
 		 */
@@ -364,11 +924,12 @@ void cmd_cat(BaseSequentialStream *chp, int argc, char *argv[]) {
 		/*
 		 * Read the file.
 		 */
-		err=f_read(&fsrc,Buffer,ByteToRead,&ByteRead);
+		err=f_read(fsrc,Buffer,ByteToRead,&ByteRead);
 		if (err != FR_OK) {
 			chprintf(chp, "FS: f_read() failed\r\n");
 			verbose_error(chp, err);
-			f_close(&fsrc);
+			f_close(fsrc);
+			fsFileFree(fsrc);
 			return;
 		}
 		chprintf(chp, "%s", Buffer);
@@ -377,10 +938,32 @@ void cmd_cat(BaseSequentialStream *chp, int argc, char *argv[]) {
 	/*
 	 * Close the file.
 	 */
-	f_close(&fsrc);
+	f_close(fsrc);
+	fsFileFree(fsrc);
 	return;
 }
 
+/*
+ * The commands sharing fbuff and wbuff refuse to run while another one,
+ * usually a background job, holds them.
+ */
+#define FAT_BUFFERED(name)                                                  \
+void cmd_##name(BaseSequentialStream *chp, int argc, char *argv[]) {        \
+	if (!chMtxTryLock(&fatBufMtx)) {                                          \
+		chprintf(chp, "FS: busy, see jobs\r\n");                               \
+		return;                                                                 \
+	}                                                                         \
+	fat_##name(chp, argc, argv);                                              \
+	chMtxUnlock();                                                            \
+}
+
+FAT_BUFFERED(mkfs)
+FAT_BUFFERED(sdinfo)
+FAT_BUFFERED(tree)
+FAT_BUFFERED(hello)
+FAT_BUFFERED(cp)
+FAT_BUFFERED(sdbench)
+
 void verbose_error(BaseSequentialStream *chp, FRESULT err) {
 	chprintf(chp, "\t%s.\r\n",fresult_str(err));
 }
@@ -12,6 +12,23 @@
 
 #define _USE_LAVEL 1
 
+/**
+ * @brief   Longest wait of a file operation for the background mount.
+ */
+#if !defined(FAT_READY_TIMEOUT_MS)
+#define FAT_READY_TIMEOUT_MS    5000
+#endif
+
+/**
+ * @brief   Volume states.
+ */
+typedef enum {
+  FAT_UNMOUNTED = 0,
+  FAT_MOUNTING,
+  FAT_READY,
+  FAT_FAILED                /* Card missing or no file system, see result.  */
+} fatstate_t;
+
 /**
  * @brief FS object.
  */
@@ -19,10 +36,19 @@
 /*
 static FATFS SDC_FS;
 */
+void fatInit(void);
+void fatMount(void);
+bool_t fatUnmount(void);
+FRESULT fatWaitReady(systime_t timeout);
+fatstate_t fatGetState(void);
 FRESULT scan_files(BaseSequentialStream *chp, char *path);
 void cmd_mount(BaseSequentialStream *chp, int argc, char *argv[]);
 void cmd_unmount(BaseSequentialStream *chp, int argc, char *argv[]);
 void cmd_free(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_sdinfo(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_sdbench(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_cp(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_ramdisk(BaseSequentialStream *chp, int argc, char *argv[]);
 void cmd_tree(BaseSequentialStream *chp, int argc, char *argv[]);
 void cmd_mkfs(BaseSequentialStream *chp, int argc, char *argv[]);
 void cmd_setlabel(BaseSequentialStream *chp, int argc, char *argv[]);
@@ -0,0 +1,137 @@
+/*
+ * fspool.c
+ *
+ *  Fixed block pools for the FatFs objects and the FatFs OS bindings.
+ *
+ *  File, directory and LFN buffers come from static pools of bounded size
+ *  instead of thread stacks and the heap, so the worst case memory use is
+ *  known at link time and long runs do not fragment the heap. Replaces the
+ *  generic ChibiOS fatfs_syscall.c, the volume semaphores are static too.
+ */
+
+#include "ch.h"
+#include "hal.h"
+#include "ff.h"
+
+#include "fspool.h"
+#include "memmap.h"
+
+#define FS_LFN_SIZE     ((_MAX_LFN + 1) * sizeof(WCHAR))
+
+/*
+ * A pool and its usage.
+ */
+typedef struct {
+	MemoryPool pool;
+	FsPoolStats stats;
+} FsPool;
+
+/* File sector buffers are SDIO DMA targets, the others stay off SRAM.*/
+static FIL fsFiles[FS_FILE_POOL];
+static CCM_DATA DIR fsDirs[FS_DIR_POOL];
+/* Word aligned, the pool links the free blocks through their first word.*/
+static CCM_DATA uint32_t fsLfns[FS_LFN_POOL][FS_LFN_SIZE / sizeof(uint32_t)];
+
+static FsPool fsPools[] = {
+	{_MEMORYPOOL_DATA(fsPools[0].pool, sizeof(FIL), NULL),
+			{"FIL", sizeof(FIL), FS_FILE_POOL, 0, 0, 0}},
+	{_MEMORYPOOL_DATA(fsPools[1].pool, sizeof(DIR), NULL),
+			{"DIR", sizeof(DIR), FS_DIR_POOL, 0, 0, 0}},
+	{_MEMORYPOOL_DATA(fsPools[2].pool, FS_LFN_SIZE, NULL),
+			{"LFN", FS_LFN_SIZE, FS_LFN_POOL, 0, 0, 0}}
+};
+#define FS_POOLS        (sizeof(fsPools) / sizeof(fsPools[0]))
+
+#if _FS_REENTRANT
+static Semaphore fsSems[_VOLUMES];
+#endif
+
+void fsPoolInit(void) {
+	memAssertDma(fsFiles);
+	chPoolLoadArray(&fsPools[0].pool, fsFiles, FS_FILE_POOL);
+	chPoolLoadArray(&fsPools[1].pool, fsDirs, FS_DIR_POOL);
+	chPoolLoadArray(&fsPools[2].pool, fsLfns, FS_LFN_POOL);
+}
+
+static void *fs_alloc(FsPool *fpp) {
+	void *p;
+
+	chSysLock();
+	p = chPoolAllocI(&fpp->pool);
+	if (p != NULL) {
+		if (++fpp->stats.used > fpp->stats.peak) {
+			fpp->stats.peak = fpp->stats.used;
+		}
+	} else {
+		fpp->stats.fails++;
+	}
+	chSysUnlock();
+	return p;
+}
+
+static void fs_free(FsPool *fpp, void *p) {
+	chSysLock();
+	chPoolFreeI(&fpp->pool, p);
+	fpp->stats.used--;
+	chSysUnlock();
+}
+
+FIL *fsFileAlloc(void) {
+	return fs_alloc(&fsPools[0]);
+}
+
+void fsFileFree(FIL *fp) {
+	fs_free(&fsPools[0], fp);
+}
+
+DIR *fsDirAlloc(void) {
+	return fs_alloc(&fsPools[1]);
+}
+
+void fsDirFree(DIR *dp) {
+	fs_free(&fsPools[1], dp);
+}
+
+/*
+ * Usage of the pool i, NULL past the last one.
+ */
+const FsPoolStats *fsPoolGetStats(uint32_t i) {
+	return i < FS_POOLS ? &fsPools[i].stats : NULL;
+}
+
+#if _FS_REENTRANT
+int ff_cre_syncobj(BYTE vol, _SYNC_t *sobj) {
+	*sobj = &fsSems[vol];
+	chSemInit(*sobj, 1);
+	return TRUE;
+}
+
+int ff_del_syncobj(_SYNC_t sobj) {
+	(void)sobj;
+	return TRUE;
+}
+
+int ff_req_grant(_SYNC_t sobj) {
+	return chSemWaitTimeout(sobj, (systime_t)_FS_TIMEOUT) == RDY_OK;
+}
+
+void ff_rel_grant(_SYNC_t sobj) {
+	chSemSignal(sobj);
+}
+#endif /* _FS_REENTRANT */
+
+#if _USE_LFN == 3
+/*
+ * FatFs only asks for LFN working buffers.
+ */
+void *ff_memalloc(UINT size) {
+	if (size > FS_LFN_SIZE) {
+		return NULL;
+	}
+	return fs_alloc(&fsPools[2]);
+}
+
+void ff_memfree(void *mblock) {
+	fs_free(&fsPools[2], mblock);
+}
+#endif /* _USE_LFN == 3 */
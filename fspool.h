@@ -0,0 +1,53 @@
+/*
+ * fspool.h
+ *
+ *  Fixed block pools for the FatFs objects and the FatFs OS bindings.
+ */
+
+#ifndef FSPOOL_H_
+#define FSPOOL_H_
+
+#include "ff.h"
+
+/**
+ * @brief   File objects, each carries a sector buffer.
+ */
+#if !defined(FS_FILE_POOL)
+#define FS_FILE_POOL            4
+#endif
+
+/**
+ * @brief   Directory objects.
+ * @note    Bounds the depth of a tree listing.
+ */
+#if !defined(FS_DIR_POOL)
+#define FS_DIR_POOL             6
+#endif
+
+/**
+ * @brief   LFN working buffers, one per FatFs call in progress.
+ */
+#if !defined(FS_LFN_POOL)
+#define FS_LFN_POOL             4
+#endif
+
+/**
+ * @brief   Pool usage, for mem.
+ */
+typedef struct {
+  const char *name;
+  uint32_t size;            /* Object size in bytes.                        */
+  uint32_t count;
+  uint32_t used;
+  uint32_t peak;
+  uint32_t fails;           /* Allocations refused, pool empty.             */
+} FsPoolStats;
+
+void fsPoolInit(void);
+FIL *fsFileAlloc(void);
+void fsFileFree(FIL *fp);
+DIR *fsDirAlloc(void);
+void fsDirFree(DIR *dp);
+const FsPoolStats *fsPoolGetStats(uint32_t i);
+
+#endif /* FSPOOL_H_ */
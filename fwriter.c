@@ -0,0 +1,519 @@
+/*
+ * fwriter.c
+ *
+ *  Write coalescing buffered stream on top of a FatFs file.
+ *
+ *  Small writes are collected in a caller supplied buffer and handed to
+ *  f_write() in large chunks that end on a sector boundary, so FatFs never
+ *  has to read-modify-write its sector window. Writes at least as large as
+ *  the buffer go straight to f_write() when the file is sector aligned.
+ *
+ *  Each open writer follows a durability policy: it is synced once a given
+ *  amount of data or a given age of unsynced data is reached, bounding what
+ *  a power cut can lose while keeping directory and FAT updates batched.
+ */
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+
+#include "fat.h"
+#include "fwriter.h"
+#include "memmap.h"
+#include "sdcard.h"
+#include "timing.h"
+
+/*
+ * Open writers, walked by the sync thread and the logs command.
+ */
+static FileWriter *fwList = NULL;
+static MUTEX_DECL(fwListMtx);
+
+TIMING_SITE(fwWriteTiming, "fw.f_write");
+TIMING_SITE(fwSyncTiming, "fw.f_sync");
+
+static FRESULT fw_output(FileWriter *fwp, const uint8_t *data, UINT n) {
+	UINT written;
+	FRESULT err;
+
+	TIMING(fwWriteTiming, err = f_write(&fwp->file, data, n, &written));
+	fwp->stats.writes++;
+	fwp->stats.fsbytes += written;
+	if (err == FR_OK && written != n) {
+		err = FR_DENIED;	/* Volume full. */
+	}
+	if (err != FR_OK) {
+		fwp->err = err;
+	}
+	return err;
+}
+
+/*
+ * Write out the buffer up to the last sector boundary of the file, the tail
+ * stays buffered unless all is set.
+ */
+static FRESULT fw_drain(FileWriter *fwp, bool_t all) {
+	uint32_t n, tail;
+	FRESULT err;
+
+	n = fwp->fill;
+	if (!all) {
+		tail = (f_tell(&fwp->file) + n) % _MAX_SS;
+		if (tail < n) {
+			n -= tail;
+		}
+	}
+	if (n == 0) {
+		return FR_OK;
+	}
+	err = fw_output(fwp, fwp->buf, n);
+	if (err != FR_OK) {
+		return err;
+	}
+	fwp->fill -= n;
+	memmove(fwp->buf, fwp->buf + n, fwp->fill);
+	return FR_OK;
+}
+
+/*
+ * Commit everything accepted so far, data, directory entry and FAT are
+ * written by a single f_sync().
+ */
+static FRESULT fw_sync(FileWriter *fwp) {
+	systime_t age;
+	FRESULT err;
+
+	if (fwp->err != FR_OK) {
+		return fwp->err;
+	}
+	if (fwp->unsynced == 0) {
+		return FR_OK;
+	}
+	age = chTimeNow() - fwp->dirty;
+	if (fwp->unsynced > fwp->stats.maxbytes) {
+		fwp->stats.maxbytes = fwp->unsynced;
+	}
+	if (age > fwp->stats.maxage) {
+		fwp->stats.maxage = age;
+	}
+	err = fw_drain(fwp, TRUE);
+	if (err == FR_OK) {
+		TIMING(fwSyncTiming, err = f_sync(&fwp->file));
+		fwp->stats.syncs++;
+	}
+	if (err != FR_OK) {
+		fwp->err = err;
+		return err;
+	}
+	fwp->unsynced = 0;
+	return FR_OK;
+}
+
+static bool_t fw_sync_due(FileWriter *fwp) {
+	if (fwp->unsynced == 0) {
+		return FALSE;
+	}
+	if (fwp->policy.bytes > 0 && fwp->unsynced >= fwp->policy.bytes) {
+		return TRUE;
+	}
+	if (fwp->policy.interval > 0 &&
+			chTimeNow() - fwp->dirty >= MS2ST(fwp->policy.interval)) {
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static size_t writes(void *ip, const uint8_t *bp, size_t n) {
+	return fwWrite((FileWriter *)ip, bp, n) == FR_OK ? n : 0;
+}
+
+static size_t reads(void *ip, uint8_t *bp, size_t n) {
+	(void)ip;
+	(void)bp;
+	(void)n;
+	return 0;
+}
+
+static msg_t put(void *ip, uint8_t b) {
+	return fwWrite((FileWriter *)ip, &b, 1) == FR_OK ? RDY_OK : RDY_RESET;
+}
+
+static msg_t get(void *ip) {
+	(void)ip;
+	return RDY_RESET;
+}
+
+static const struct FileWriterVMT vmt = {writes, reads, put, get};
+
+/*
+ * Enforces the time based policies even when the writers go quiet. The
+ * stack is the one of the Mount thread, f_sync() goes down to the card
+ * recovery on errors.
+ */
+static CCM_DATA WORKING_AREA(fwSyncThreadWA, 1024);
+static msg_t fwSyncThread(void *arg) {
+	FileWriter *fwp;
+
+	(void)arg;
+	chRegSetThreadName("FileSync");
+	while (TRUE) {
+		chThdSleepMilliseconds(FW_SYNC_POLL_MS);
+		chMtxLock(&fwListMtx);
+		for (fwp = fwList; fwp != NULL; fwp = fwp->next) {
+			chMtxLock(&fwp->mtx);
+			if (fw_sync_due(fwp)) {
+				fw_sync(fwp);
+			}
+			chMtxUnlock();
+		}
+		chMtxUnlock();
+	}
+	return (msg_t)NULL;
+}
+
+void fwInit(void) {
+	chThdCreateStatic(fwSyncThreadWA, sizeof(fwSyncThreadWA),
+			NORMALPRIO - 1, fwSyncThread, NULL);
+}
+
+/*
+ * Initialize the writer with its buffer, size is rounded down to a multiple
+ * of the sector size and must hold one sector at least. The default policy
+ * syncs on fwSync() and fwClose() only.
+ */
+void fwObjectInit(FileWriter *fwp, uint8_t *buf, uint32_t size) {
+	chDbgCheck(size >= _MAX_SS, "fwObjectInit");
+	fwp->vmt = &vmt;
+	fwp->buf = buf;
+	fwp->size = size - size % _MAX_SS;
+	fwp->fill = 0;
+	fwp->err = FR_OK;
+	fwp->policy.bytes = 0;
+	fwp->policy.interval = 0;
+	fwp->prealloc = 0;
+	fwp->unsynced = 0;
+	fwp->next = NULL;
+	fwp->name[0] = 0;
+	memset(&fwp->stats, 0, sizeof(fwp->stats));
+	chMtxInit(&fwp->mtx);
+}
+
+/*
+ * Sync every bytes unsynced bytes and/or when the oldest unsynced byte is
+ * interval ms old, zero disables the respective limit.
+ */
+void fwSetPolicy(FileWriter *fwp, uint32_t bytes, uint32_t interval) {
+	chMtxLock(&fwp->mtx);
+	fwp->policy.bytes = bytes;
+	fwp->policy.interval = interval;
+	chMtxUnlock();
+}
+
+/*
+ * A writer already open is refused, it would be listed twice, and so is
+ * one without a whole sector of buffer, its writes would never progress.
+ */
+FRESULT fwOpen(FileWriter *fwp, const TCHAR *path, BYTE mode) {
+	FileWriter *p;
+
+	if (fwp->size == 0) {
+		return FR_INVALID_PARAMETER;
+	}
+	chMtxLock(&fwListMtx);
+	for (p = fwList; p != NULL && p != fwp; p = p->next) {
+	}
+	chMtxUnlock();
+	if (p != NULL) {
+		return FR_LOCKED;
+	}
+	fwp->fill = 0;
+	fwp->prealloc = 0;
+	fwp->unsynced = 0;
+	memset(&fwp->stats, 0, sizeof(fwp->stats));
+	strncpy(fwp->name, path, sizeof(fwp->name) - 1);
+	fwp->name[sizeof(fwp->name) - 1] = 0;
+	/* The first log of a boot waits for the background mount.*/
+	fwp->err = fatWaitReady(MS2ST(FAT_READY_TIMEOUT_MS));
+	if (fwp->err == FR_OK) {
+		fwp->err = f_open(&fwp->file, path, mode);
+	}
+	if (fwp->err != FR_OK) {
+		return fwp->err;
+	}
+	chMtxLock(&fwListMtx);
+	fwp->next = fwList;
+	fwList = fwp;
+	chMtxUnlock();
+	return FR_OK;
+}
+
+/*
+ * Allocate the clusters of a log up front so that the appends never walk
+ * the FAT looking for free space. The unused tail is released by
+ * fwClose(), and erased in background by the disk layer. The size is
+ * rounded up to the granularity advised for the card.
+ */
+FRESULT fwPreallocate(FileWriter *fwp, uint32_t size) {
+	const SDCardInfo *info = sdcardGetInfo();
+	DWORD pos;
+	FRESULT err;
+
+	if (info->valid && info->prealloc > 0) {
+		size = (size + info->prealloc - 1) / info->prealloc * info->prealloc;
+	}
+	chMtxLock(&fwp->mtx);
+	err = fwp->err;
+	if (err == FR_OK) {
+		err = fw_drain(fwp, TRUE);
+	}
+	if (err == FR_OK && size > f_size(&fwp->file)) {
+		pos = f_tell(&fwp->file);
+		err = f_lseek(&fwp->file, size);
+		if (err == FR_OK && f_tell(&fwp->file) != size) {
+			err = FR_DENIED;
+		}
+		if (err == FR_OK) {
+			err = f_lseek(&fwp->file, pos);
+		}
+		if (err == FR_OK) {
+			fwp->prealloc = size;
+		}
+	}
+	chMtxUnlock();
+	return err;
+}
+
+FRESULT fwWrite(FileWriter *fwp, const void *data, UINT n) {
+	const uint8_t *p = data;
+	uint32_t chunk;
+	FRESULT err = FR_OK;
+
+	chMtxLock(&fwp->mtx);
+	if (fwp->err != FR_OK) {
+		chMtxUnlock();
+		return fwp->err;
+	}
+	fwp->stats.bytes += n;
+	if (fwp->unsynced == 0) {
+		fwp->dirty = chTimeNow();
+	}
+	fwp->unsynced += n;
+	while (n > 0) {
+		/*
+		 * Aligned pass-through of whole sectors for large writes.
+		 */
+		if (fwp->fill == 0 && n >= fwp->size &&
+				f_tell(&fwp->file) % _MAX_SS == 0) {
+			chunk = n - n % _MAX_SS;
+			err = fw_output(fwp, p, chunk);
+			if (err != FR_OK) {
+				break;
+			}
+			fwp->stats.direct++;
+			p += chunk;
+			n -= chunk;
+			continue;
+		}
+		chunk = fwp->size - fwp->fill;
+		if (chunk > n) {
+			chunk = n;
+		}
+		memcpy(fwp->buf + fwp->fill, p, chunk);
+		fwp->fill += chunk;
+		p += chunk;
+		n -= chunk;
+		if (fwp->fill == fwp->size) {
+			err = fw_drain(fwp, FALSE);
+			if (err != FR_OK) {
+				break;
+			}
+		}
+	}
+	if (err == FR_OK && fw_sync_due(fwp)) {
+		err = fw_sync(fwp);
+	}
+	chMtxUnlock();
+	return err;
+}
+
+FRESULT fwPuts(FileWriter *fwp, const TCHAR *str) {
+	return fwWrite(fwp, str, strlen(str));
+}
+
+FRESULT fwFlush(FileWriter *fwp) {
+	FRESULT err;
+
+	chMtxLock(&fwp->mtx);
+	err = fwp->err;
+	if (err == FR_OK) {
+		err = fw_drain(fwp, TRUE);
+	}
+	chMtxUnlock();
+	return err;
+}
+
+/*
+ * Sync on event, the application calls it when a record must be durable.
+ */
+FRESULT fwSync(FileWriter *fwp) {
+	FRESULT err;
+
+	chMtxLock(&fwp->mtx);
+	err = fw_sync(fwp);
+	chMtxUnlock();
+	return err;
+}
+
+FRESULT fwSyncAll(void) {
+	FileWriter *fwp;
+	FRESULT err, res = FR_OK;
+
+	chMtxLock(&fwListMtx);
+	for (fwp = fwList; fwp != NULL; fwp = fwp->next) {
+		chMtxLock(&fwp->mtx);
+		err = fw_sync(fwp);
+		chMtxUnlock();
+		if (err != FR_OK) {
+			res = err;
+		}
+	}
+	chMtxUnlock();
+	return res;
+}
+
+FRESULT fwClose(FileWriter *fwp) {
+	FileWriter **fwpp;
+	FRESULT err, cerr;
+
+	chMtxLock(&fwListMtx);
+	for (fwpp = &fwList; *fwpp != NULL; fwpp = &(*fwpp)->next) {
+		if (*fwpp == fwp) {
+			*fwpp = fwp->next;
+			break;
+		}
+	}
+	chMtxUnlock();
+	chMtxLock(&fwp->mtx);
+	err = fwp->err;
+	if (err == FR_OK) {
+		err = fw_drain(fwp, TRUE);
+	}
+	/*
+	 * Release what was preallocated but not used.
+	 */
+	if (err == FR_OK && fwp->prealloc > 0 && f_tell(&fwp->file) < f_size(&fwp->file)) {
+		err = f_truncate(&fwp->file);
+	}
+	cerr = f_close(&fwp->file);
+	if (cerr == FR_OK) {
+		fwp->unsynced = 0;
+	}
+	chMtxUnlock();
+	return err != FR_OK ? err : cerr;
+}
+
+uint32_t fwOpenCount(void) {
+	FileWriter *fwp;
+	uint32_t n = 0;
+
+	chMtxLock(&fwListMtx);
+	for (fwp = fwList; fwp != NULL; fwp = fwp->next) {
+		n++;
+	}
+	chMtxUnlock();
+	return n;
+}
+
+/*
+ * A writer as listed by the logs command.
+ */
+typedef struct {
+	char name[FW_NAME_SIZE];
+	FileWriterStats stats;
+	FileWriterPolicy policy;
+	uint32_t unsynced;
+	uint32_t age;
+	FRESULT err;
+} FileWriterInfo;
+
+/*
+ * List the open writers with their policy and the data at risk. They are
+ * copied under the locks and printed after, a host not reading the USB
+ * serial would otherwise stall the sync thread and the writers.
+ */
+void cmd_logs(BaseSequentialStream *chp, int argc, char *argv[]) {
+	FileWriterInfo logs[FW_LIST_MAX], *ip;
+	FileWriter *fwp;
+	uint32_t i, n = 0, more = 0;
+	(void)argv;
+	if (argc > 0) {
+		chprintf(chp, "Usage: logs\r\n");
+		chprintf(chp, "       Lists open logs and their data-at-risk window\r\n");
+		return;
+	}
+	chMtxLock(&fwListMtx);
+	for (fwp = fwList; fwp != NULL; fwp = fwp->next) {
+		if (n == FW_LIST_MAX) {
+			more++;
+			continue;
+		}
+		ip = &logs[n++];
+		chMtxLock(&fwp->mtx);
+		memcpy(ip->name, fwp->name, sizeof(ip->name));
+		ip->stats = fwp->stats;
+		ip->policy = fwp->policy;
+		ip->unsynced = fwp->unsynced;
+		ip->age = fwp->unsynced > 0 ? (uint32_t)(chTimeNow() - fwp->dirty) : 0;
+		ip->err = fwp->err;
+		chMtxUnlock();
+	}
+	chMtxUnlock();
+	if (n == 0) {
+		chprintf(chp, "no open logs\r\n");
+	}
+	for (i = 0; i < n; i++) {
+		ip = &logs[i];
+		chprintf(chp, "%s: %lu B, %lu writes, %lu B average, %lu syncs\r\n",
+			ip->name, ip->stats.bytes, ip->stats.writes,
+			ip->stats.writes ? ip->stats.fsbytes / ip->stats.writes : 0,
+			ip->stats.syncs);
+		chprintf(chp, "    at risk now %lu B / %lu ms, max seen %lu B / %lu ms\r\n",
+			ip->unsynced, ip->age * 1000 / CH_FREQUENCY,
+			ip->stats.maxbytes, (uint32_t)ip->stats.maxage * 1000 / CH_FREQUENCY);
+		chprintf(chp, "    bound ");
+		if (ip->policy.bytes == 0 && ip->policy.interval == 0) {
+			chprintf(chp, "none, synced on event or close only");
+		}
+		if (ip->policy.bytes > 0) {
+			chprintf(chp, "%lu B ", ip->policy.bytes);
+		}
+		if (ip->policy.interval > 0) {
+			chprintf(chp, "%lu ms", ip->policy.interval + FW_SYNC_POLL_MS);
+		}
+		chprintf(chp, "\r\n");
+		if (ip->err != FR_OK) {
+			verbose_error(chp, ip->err);
+		}
+	}
+	if (more > 0) {
+		chprintf(chp, "%lu more not listed\r\n", more);
+	}
+}
+
+void cmd_sync(BaseSequentialStream *chp, int argc, char *argv[]) {
+	FRESULT err;
+	(void)argv;
+	if (argc > 0) {
+		chprintf(chp, "Usage: sync\r\n");
+		chprintf(chp, "       Syncs all open logs now\r\n");
+		return;
+	}
+	err = fwSyncAll();
+	if (err != FR_OK) {
+		chprintf(chp, "FS: f_sync() failed\r\n");
+		verbose_error(chp, err);
+	}
+}
@@ -0,0 +1,117 @@
+/*
+ * fwriter.h
+ *
+ *  Write coalescing buffered stream on top of a FatFs file.
+ */
+
+#ifndef FWRITER_H_
+#define FWRITER_H_
+
+#include "ff.h"
+
+/**
+ * @brief   Default buffer size, a multiple of the sector size.
+ * @note    Best results with the cluster size of the volume.
+ */
+#if !defined(FW_BUFFER_SIZE)
+#define FW_BUFFER_SIZE          8192
+#endif
+
+/**
+ * @brief   Period of the background check for time based syncs.
+ */
+#if !defined(FW_SYNC_POLL_MS)
+#define FW_SYNC_POLL_MS         100
+#endif
+
+/**
+ * @brief   Maximum name length kept for reporting.
+ */
+#if !defined(FW_NAME_SIZE)
+#define FW_NAME_SIZE            16
+#endif
+
+/**
+ * @brief   Most writers listed by the logs command.
+ */
+#if !defined(FW_LIST_MAX)
+#define FW_LIST_MAX             8
+#endif
+
+/**
+ * @brief   Durability policy.
+ * @details The file is synced, data, directory entry and FAT in a single
+ *          f_sync(), as soon as one of the enabled limits is reached.
+ *          With both limits at zero the file is only synced by fwSync()
+ *          (on event) and fwClose().
+ */
+typedef struct {
+  uint32_t bytes;           /* Unsynced bytes limit, 0 disables.            */
+  uint32_t interval;        /* Unsynced age limit in ms, 0 disables.        */
+} FileWriterPolicy;
+
+/**
+ * @brief   Per stream statistics.
+ */
+typedef struct {
+  uint32_t bytes;           /* Bytes accepted from the user.                */
+  uint32_t fsbytes;         /* Bytes handed to f_write().                   */
+  uint32_t writes;          /* f_write() calls issued.                      */
+  uint32_t direct;          /* Writes that bypassed the buffer.             */
+  uint32_t syncs;           /* f_sync() calls issued.                       */
+  uint32_t maxbytes;        /* Largest amount of data found at risk.        */
+  systime_t maxage;         /* Oldest data found at risk, in ticks.         */
+} FileWriterStats;
+
+/**
+ * @brief   @p FileWriter virtual methods table.
+ */
+struct FileWriterVMT {
+  _base_sequential_stream_methods
+};
+
+/**
+ * @brief   Buffered writer, usable as a @p BaseSequentialStream so that
+ *          chprintf() can target a file.
+ */
+typedef struct FileWriter FileWriter;
+struct FileWriter {
+  const struct FileWriterVMT *vmt;
+  _base_sequential_stream_data
+  FIL file;
+  uint8_t *buf;
+  uint32_t size;
+  uint32_t fill;
+  FRESULT err;
+  FileWriterStats stats;
+  FileWriterPolicy policy;
+  uint32_t prealloc;        /* Preallocated size, 0 if none.                */
+  uint32_t unsynced;        /* Bytes accepted since the last sync.          */
+  systime_t dirty;          /* Time of the oldest unsynced byte.            */
+  Mutex mtx;
+  char name[FW_NAME_SIZE];
+  FileWriter *next;         /* Open writers list.                           */
+};
+
+/**
+ * @brief   Average size of the writes reaching FatFs.
+ */
+#define fwAverageWrite(fwp)                                                 \
+  ((fwp)->stats.writes ? (fwp)->stats.fsbytes / (fwp)->stats.writes : 0)
+
+void fwInit(void);
+void fwObjectInit(FileWriter *fwp, uint8_t *buf, uint32_t size);
+void fwSetPolicy(FileWriter *fwp, uint32_t bytes, uint32_t interval);
+FRESULT fwOpen(FileWriter *fwp, const TCHAR *path, BYTE mode);
+FRESULT fwPreallocate(FileWriter *fwp, uint32_t size);
+FRESULT fwWrite(FileWriter *fwp, const void *data, UINT n);
+FRESULT fwPuts(FileWriter *fwp, const TCHAR *str);
+FRESULT fwFlush(FileWriter *fwp);
+FRESULT fwSync(FileWriter *fwp);
+FRESULT fwSyncAll(void);
+uint32_t fwOpenCount(void);
+FRESULT fwClose(FileWriter *fwp);
+void cmd_logs(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_sync(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* FWRITER_H_ */
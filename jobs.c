@@ -0,0 +1,361 @@
+/*
+ * jobs.c
+ *
+ *  Shell commands run in background worker threads.
+ *
+ *  A command line ending with "&" is copied to a free worker and runs
+ *  there, printing into an output ring instead of the shell stream so that
+ *  the shell stays usable. jobs lists them, fg prints the output of one and
+ *  follows it, kill asks one to stop. Stopping is cooperative: long loops
+ *  poll jobCancelled().
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+#include "shell.h"
+
+#include "jobs.h"
+
+/*
+ * A worker and the job it runs or last ran.
+ */
+typedef struct {
+	Thread *tp;
+	BinarySemaphore go;
+	jobstate_t state;
+	uint32_t id;
+	bool_t cancel;
+	shellcmd_t cmd;
+	const char *name;
+	int argc;
+	char *argv[JOB_MAX_ARGUMENTS + 1];
+	char line[JOB_LINE_SIZE];
+	systime_t start;
+	systime_t end;
+	JobStream out;
+} Job;
+
+/* In SRAM, the commands hand stack buffers to the SDIO DMA.*/
+static WORKING_AREA(jobWA[JOB_WORKERS], JOB_WA_SIZE);
+static Job jobs[JOB_WORKERS];
+static uint32_t jobNextId = 1;
+
+/*
+ * Protects the job states and the output rings.
+ */
+static MUTEX_DECL(jobMtx);
+
+static const char *jobStates[] = {"free", "running", "done", "killed"};
+
+static size_t writes(void *ip, const uint8_t *bp, size_t n) {
+	JobStream *jsp = ip;
+	size_t i;
+
+	chMtxLock(&jobMtx);
+	for (i = 0; i < n; i++) {
+		jsp->buf[(jsp->head + jsp->count) % JOB_OUTPUT_SIZE] = bp[i];
+		if (jsp->count < JOB_OUTPUT_SIZE) {
+			jsp->count++;
+		} else {
+			jsp->head = (jsp->head + 1) % JOB_OUTPUT_SIZE;
+			jsp->dropped++;
+		}
+	}
+	chMtxUnlock();
+	return n;
+}
+
+static size_t reads(void *ip, uint8_t *bp, size_t n) {
+	(void)ip;
+	(void)bp;
+	(void)n;
+	return 0;
+}
+
+static msg_t put(void *ip, uint8_t b) {
+	writes(ip, &b, 1);
+	return RDY_OK;
+}
+
+static msg_t get(void *ip) {
+	(void)ip;
+	return RDY_RESET;
+}
+
+static const struct JobStreamVMT vmt = {writes, reads, put, get};
+
+/*
+ * Take up to n bytes of output, the lock is held.
+ */
+static size_t job_take(Job *jp, uint8_t *bp, size_t n) {
+	JobStream *jsp = &jp->out;
+	size_t i;
+
+	for (i = 0; i < n && jsp->count > 0; i++) {
+		bp[i] = jsp->buf[jsp->head];
+		jsp->head = (jsp->head + 1) % JOB_OUTPUT_SIZE;
+		jsp->count--;
+	}
+	return i;
+}
+
+static msg_t jobThread(void *arg) {
+	Job *jp = arg;
+
+	chRegSetThreadName("job");
+	while (TRUE) {
+		chBSemWait(&jp->go);
+		jp->cmd((BaseSequentialStream *)&jp->out, jp->argc, jp->argv);
+		chMtxLock(&jobMtx);
+		jp->state = jp->cancel ? JOB_KILLED : JOB_DONE;
+		jp->end = chTimeNow();
+		chMtxUnlock();
+	}
+	return (msg_t)NULL;
+}
+
+void jobInit(void) {
+	uint32_t i;
+
+	for (i = 0; i < JOB_WORKERS; i++) {
+		jobs[i].out.vmt = &vmt;
+		chBSemInit(&jobs[i].go, TRUE);
+		jobs[i].tp = chThdCreateStatic(jobWA[i], sizeof(jobWA[i]),
+				NORMALPRIO - 1, jobThread, &jobs[i]);
+	}
+}
+
+/*
+ * A free worker, or the one holding the oldest finished job. The lock is
+ * held.
+ */
+static Job *job_slot(void) {
+	Job *jp = NULL;
+	uint32_t i;
+
+	for (i = 0; i < JOB_WORKERS; i++) {
+		if (jobs[i].state == JOB_FREE) {
+			return &jobs[i];
+		}
+		if (jobs[i].state != JOB_RUNNING && (jp == NULL || jobs[i].id < jp->id)) {
+			jp = &jobs[i];
+		}
+	}
+	return jp;
+}
+
+/*
+ * The job with the given id, or the oldest one for id 0.
+ */
+static Job *job_find(uint32_t id) {
+	Job *jp = NULL;
+	uint32_t i;
+
+	for (i = 0; i < JOB_WORKERS; i++) {
+		if (jobs[i].state == JOB_FREE) {
+			continue;
+		}
+		if (id != 0 && jobs[i].id == id) {
+			return &jobs[i];
+		}
+		if (id == 0 && (jp == NULL || jobs[i].id < jp->id)) {
+			jp = &jobs[i];
+		}
+	}
+	return jp;
+}
+
+/*
+ * Run cmd in the shell thread, or as a job when the last argument is "&".
+ */
+void jobRun(BaseSequentialStream *chp, const char *name, shellcmd_t cmd,
+		int argc, char *argv[]) {
+	Job *jp;
+	size_t len, used = 0;
+	int i;
+
+	if (argc == 0 || strcmp(argv[argc - 1], "&") != 0) {
+		cmd(chp, argc, argv);
+		return;
+	}
+	argc--;
+	if (strncmp(name, "cmd_", 4) == 0) {
+		name += 4;
+	}
+	chMtxLock(&jobMtx);
+	jp = job_slot();
+	if (jp == NULL) {
+		chMtxUnlock();
+		chprintf(chp, "jobs: all %u workers busy\r\n", JOB_WORKERS);
+		return;
+	}
+	/* The shell reuses its line buffer, the arguments are copied.*/
+	for (i = 0; i < argc && i < JOB_MAX_ARGUMENTS; i++) {
+		len = strlen(argv[i]) + 1;
+		if (used + len > sizeof(jp->line)) {
+			break;
+		}
+		memcpy(&jp->line[used], argv[i], len);
+		jp->argv[i] = &jp->line[used];
+		used += len;
+	}
+	if (i < argc) {
+		chMtxUnlock();
+		chprintf(chp, "jobs: command line too long\r\n");
+		return;
+	}
+	jp->argv[argc] = NULL;
+	jp->argc = argc;
+	jp->cmd = cmd;
+	jp->name = name;
+	jp->id = jobNextId++;
+	jp->cancel = FALSE;
+	jp->state = JOB_RUNNING;
+	jp->start = chTimeNow();
+	jp->out.head = 0;
+	jp->out.count = 0;
+	jp->out.dropped = 0;
+	chMtxUnlock();
+	chprintf(chp, "[%lu] %s\r\n", jp->id, name);
+	chBSemSignal(&jp->go);
+}
+
+/*
+ * Cancellation point, TRUE when the job running in the calling thread has
+ * been killed. Always FALSE in the shell thread.
+ */
+bool_t jobCancelled(void) {
+	Thread *tp = chThdSelf();
+	uint32_t i;
+
+	for (i = 0; i < JOB_WORKERS; i++) {
+		if (jobs[i].tp == tp) {
+			return jobs[i].cancel;
+		}
+	}
+	return FALSE;
+}
+
+void cmd_jobs(BaseSequentialStream *chp, int argc, char *argv[]) {
+	Job *jp;
+	uint32_t i, id, ms, count, dropped;
+	jobstate_t state;
+	const char *name, *p;
+	char line[JOB_LINE_SIZE];
+	int j, args;
+	(void)argv;
+	if (argc > 0) {
+		chprintf(chp, "Usage: jobs\r\n");
+		chprintf(chp, "       Lists the background jobs, started with a trailing &\r\n");
+		return;
+	}
+	chprintf(chp, "  id   state     ms  output dropped command\r\n");
+	for (i = 0; i < JOB_WORKERS; i++) {
+		/*
+		 * Copied out under the lock, printing with it held would stall the
+		 * jobs writing their output behind a slow console.
+		 */
+		jp = &jobs[i];
+		chMtxLock(&jobMtx);
+		state = jp->state;
+		id = jp->id;
+		ms = (uint32_t)((state == JOB_RUNNING ? chTimeNow() : jp->end) - jp->start) *
+			1000 / CH_FREQUENCY;
+		count = jp->out.count;
+		dropped = jp->out.dropped;
+		name = jp->name;
+		args = jp->argc;
+		memcpy(line, jp->line, sizeof(line));
+		chMtxUnlock();
+		if (state == JOB_FREE) {
+			continue;
+		}
+		chprintf(chp, "%4lu %7s %6lu %7lu %7lu %s", id, jobStates[state], ms,
+			count, dropped, name);
+		/* The arguments are packed one after the other in the line.*/
+		for (j = 0, p = line; j < args; j++, p += strlen(p) + 1) {
+			chprintf(chp, " %s", p);
+		}
+		chprintf(chp, "\r\n");
+	}
+}
+
+/*
+ * Print the output of a job as it comes. Ctrl-C kills the job, any other
+ * key returns to the shell and leaves it running. Keys are only read from
+ * the USB serial channel, on any other stream fg follows the job to its
+ * end.
+ */
+void cmd_fg(BaseSequentialStream *chp, int argc, char *argv[]) {
+	extern SerialUSBDriver SDU1;
+	uint8_t buf[64];
+	size_t n;
+	jobstate_t state;
+	msg_t c;
+	Job *jp;
+	if (argc > 1) {
+		chprintf(chp, "Usage: fg [id]\r\n");
+		chprintf(chp, "       Follows the output of job [id], the oldest by default\r\n");
+		chprintf(chp, "       Ctrl-C kills it, any other key detaches\r\n");
+		return;
+	}
+	chMtxLock(&jobMtx);
+	jp = job_find(argc > 0 ? (uint32_t)atoi(argv[0]) : 0);
+	chMtxUnlock();
+	if (jp == NULL) {
+		chprintf(chp, "jobs: no such job\r\n");
+		return;
+	}
+	while (TRUE) {
+		chMtxLock(&jobMtx);
+		n = job_take(jp, buf, sizeof(buf));
+		state = jp->state;
+		chMtxUnlock();
+		if (n > 0) {
+			chSequentialStreamWrite(chp, buf, n);
+			continue;
+		}
+		if (state != JOB_RUNNING) {
+			chprintf(chp, "[%lu] %s\r\n", jp->id, jobStates[state]);
+			chMtxLock(&jobMtx);
+			jp->state = JOB_FREE;
+			chMtxUnlock();
+			return;
+		}
+		if (chp != (BaseSequentialStream *)&SDU1) {
+			chThdSleepMilliseconds(20);
+			continue;
+		}
+		c = chnGetTimeout((BaseChannel *)&SDU1, MS2ST(20));
+		if (c == 0x03) {
+			jp->cancel = TRUE;
+		} else if (c != Q_TIMEOUT) {
+			return;
+		}
+	}
+}
+
+void cmd_kill(BaseSequentialStream *chp, int argc, char *argv[]) {
+	Job *jp;
+	if (argc != 1) {
+		chprintf(chp, "Usage: kill id\r\n");
+		chprintf(chp, "       Stops job id at its next cancellation point\r\n");
+		return;
+	}
+	chMtxLock(&jobMtx);
+	jp = job_find((uint32_t)atoi(argv[0]));
+	if (jp != NULL && jp->state == JOB_RUNNING) {
+		jp->cancel = TRUE;
+	} else {
+		jp = NULL;
+	}
+	chMtxUnlock();
+	if (jp == NULL) {
+		chprintf(chp, "jobs: no such running job\r\n");
+	}
+}
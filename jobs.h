@@ -0,0 +1,86 @@
+/*
+ * jobs.h
+ *
+ *  Shell commands run in background worker threads.
+ */
+
+#ifndef JOBS_H_
+#define JOBS_H_
+
+/**
+ * @brief   Worker threads, the most jobs running at once.
+ */
+#if !defined(JOB_WORKERS)
+#define JOB_WORKERS             2
+#endif
+
+/**
+ * @brief   Worker stack size, the same as the shell.
+ */
+#if !defined(JOB_WA_SIZE)
+#define JOB_WA_SIZE             2048
+#endif
+
+/**
+ * @brief   Output kept per job, the oldest bytes are dropped when full.
+ */
+#if !defined(JOB_OUTPUT_SIZE)
+#define JOB_OUTPUT_SIZE         1024
+#endif
+
+/**
+ * @brief   Command line kept per job.
+ */
+#if !defined(JOB_LINE_SIZE)
+#define JOB_LINE_SIZE           64
+#endif
+
+#define JOB_MAX_ARGUMENTS       8
+
+/**
+ * @brief   Job states.
+ */
+typedef enum {
+  JOB_FREE = 0,
+  JOB_RUNNING,
+  JOB_DONE,
+  JOB_KILLED
+} jobstate_t;
+
+/**
+ * @brief   @p JobStream virtual methods table.
+ */
+struct JobStreamVMT {
+  _base_sequential_stream_methods
+};
+
+/**
+ * @brief   Output ring of a job, the stream its command prints to.
+ */
+typedef struct {
+  const struct JobStreamVMT *vmt;
+  _base_sequential_stream_data
+  uint8_t buf[JOB_OUTPUT_SIZE];
+  uint32_t head;
+  uint32_t count;
+  uint32_t dropped;
+} JobStream;
+
+/**
+ * @brief   Wraps a shell command so that a trailing "&" argument runs it
+ *          as a job, for the command table.
+ */
+#define JOB_COMMAND(cmd)                                                    \
+  static void cmd##_job(BaseSequentialStream *chp, int argc, char *argv[]) { \
+    jobRun(chp, #cmd, cmd, argc, argv);                                     \
+  }
+
+void jobInit(void);
+void jobRun(BaseSequentialStream *chp, const char *name, shellcmd_t cmd,
+            int argc, char *argv[]);
+bool_t jobCancelled(void);
+void cmd_jobs(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_fg(BaseSequentialStream *chp, int argc, char *argv[]);
+void cmd_kill(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* JOBS_H_ */
@@ -13,13 +13,14 @@
 #include "hal.h"
 
 #include "led.h"
+#include "memmap.h"
 
 BaseSequentialStream *ledSequentialStream;
 
 /*
  * Green LED blinker thread to show the system is running.
  */
-static WORKING_AREA(ledThreadWA, 128);
+static CCM_DATA WORKING_AREA(ledThreadWA, 128);
 static msg_t ledThread(void *arg) {
   (void)arg;
   chRegSetThreadName("Led");
@@ -25,9 +25,16 @@
 #include "chprintf.h"
 /* Project includes */
 #include "command.h"
+#include "disk.h"
+#include "fwriter.h"
+#include "fspool.h"
+#include "memmap.h"
 #include "mems.h"
 #include "led.h"
+#include "sysmon.h"
+#include "boot.h"
 #include "serialUSB.h"
+#include "usbcfg.h"
 
 
 /* Virtual serial port over USB.*/
@@ -42,52 +49,68 @@ extern SerialUSBDriver SDU1;
  * Application entry point.
  */
 int main(void) {
+  EventListener usbListener, shellListener;
 
   /*
    * System initializations.
+   * - CCM clearing, the startup code only clears the SRAM .bss.
    * - HAL initialization, this also initializes the configured device drivers
    *   and performs the board-specific initializations.
    * - Kernel initialization, the main() function becomes a thread and the
    *   RTOS is active.
    */
+  memInit();
+  sysmonInit();
   halInit();
+  bootMark(BOOT_HAL);
   chSysInit();
+  bootMark(BOOT_KERNEL);
 
   /*
    * Shell manager initialization.
    */
   shellInit();
   
+  fsPoolInit();                                 /* FatFs object pools */
   sdcStart(&SDCD1, NULL);                       /* Start SD Driver */
+  diskInit();                                   /* Starts the background trim */
+  fwInit();                                     /* Starts the log sync thread */
+  fatInit();                                    /* Mounts the SD card in background */
+  rawlogInit();                                 /* Checks the raw log buffers */
+  jobInit();                                    /* Starts the background job workers */
   memsInit((BaseSequentialStream *)&SDU1);      /* Initializes the SPI driver 1 in order to access the MEMS */
   ledInit((BaseSequentialStream *)&SDU1);       /* Initializes the Led blinker */
   serialUSBInit((BaseSequentialStream *)&SDU1); /* Initializes the serial-over-USB CDC driver */
 
-  serialUSBStart();
+  serialUSBStart();                             /* Connects to the host in background */
   memsStart();
   ledStart();
-  
+  bootMark(BOOT_INIT);
+
   /*
    * Set the thread name and set it to the lowest user priority
-   * Since it is just going to be in a while loop.
+   * Since it is just going to wait for USB and shell events.
    */
   chRegSetThreadName("main");
   chThdSetPriority(LOWPRIO);
+  chEvtRegisterMask(&usbEvents, &usbListener, EVENT_MASK(0));
+  chEvtRegisterMask(&shell_terminated, &shellListener, EVENT_MASK(1));
   while (TRUE) {
-    if (!cmdIsShellRunning()) {
-      if (SDU1.config->usbp->state == USB_ACTIVE) {
-        /* Spawns a new shell.*/
-        cmdShellCreate();
-      }
+    /* If the previous shell exited.*/
+    if (cmdIsShellRunning() && cmdIsShellTerminated()) {
+      /* Frees the session of the previous shell.*/
+      cmdShellRelease();
     }
-    else {
-      /* If the previous shell exited.*/
-      if (cmdIsShellTerminated()) {
-        /* Recovers memory of the previous shell.*/
-        cmdShellRelease();
-      }
+    /*
+     * Spawns a new shell once the host configured the device. A reset or
+     * a reconfiguration makes the current shell read end of file, it exits
+     * and is replaced on its termination event.
+     */
+    if (!cmdIsShellRunning() && SDU1.config->usbp->state == USB_ACTIVE) {
+      cmdShellCreate();
     }
-    chThdSleepMilliseconds(500);
+    chEvtWaitAny(EVENT_MASK(0) | EVENT_MASK(1));
+    chEvtGetAndClearFlags(&usbListener);
   }
   return (int)NULL;
 }
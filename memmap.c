@@ -0,0 +1,42 @@
+/*
+ * memmap.c
+ *
+ *  Memory placement, CCM for CPU only data and SRAM for DMA buffers.
+ */
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "memmap.h"
+
+/* From ccm.ld.*/
+extern uint8_t __ccm_start__[];
+extern uint8_t __ccm_end__[];
+
+/* Name of the misplaced buffer, for the debugger after a halt.*/
+const char *memDmaFault;
+
+/*
+ * Zero the CCM section, the startup code only clears .bss. Called first in
+ * main().
+ */
+void memInit(void) {
+	memset(__ccm_start__, 0, __ccm_end__ - __ccm_start__);
+}
+
+/*
+ * A DMA stream pointed at CCM fails silently or corrupts SRAM, stop at
+ * boot instead.
+ */
+void memCheckDma(const void *p, size_t n, const char *name) {
+	if (!memIsDmaSafe(p, n)) {
+		memDmaFault = name;
+		chSysHalt();
+	}
+}
+
+uint32_t memCcmUsed(void) {
+	return (uint32_t)(__ccm_end__ - __ccm_start__);
+}
@@ -0,0 +1,41 @@
+/*
+ * memmap.h
+ *
+ *  Memory placement, CCM for CPU only data and SRAM for DMA buffers.
+ */
+
+#ifndef MEMMAP_H_
+#define MEMMAP_H_
+
+/**
+ * @brief   Core Coupled Memory of the STM32F407.
+ */
+#define CCM_BASE                0x10000000U
+#define CCM_SIZE                0x00010000U
+
+/**
+ * @brief   Places an object in CCM, see ccm.ld.
+ * @details For thread stacks, filter state and pools that never reach a
+ *          DMA stream. Buffers handed to the SDIO, SPI or USB drivers, and
+ *          the stacks of threads passing stack buffers to them, must stay
+ *          in the default SRAM sections. The section is zeroed at boot and
+ *          initializers are not allowed.
+ */
+#define CCM_DATA                __attribute__((section(".ccm")))
+
+/**
+ * @brief   TRUE if the n bytes at p are reachable by the DMA controllers.
+ */
+#define memIsDmaSafe(p, n)                                                  \
+  ((uint32_t)(p) + (n) <= CCM_BASE || (uint32_t)(p) >= CCM_BASE + CCM_SIZE)
+
+/**
+ * @brief   Halts the system if a DMA buffer ended up in CCM.
+ */
+#define memAssertDma(buf)       memCheckDma(buf, sizeof(buf), #buf)
+
+void memInit(void);
+void memCheckDma(const void *p, size_t n, const char *name);
+uint32_t memCcmUsed(void);
+
+#endif /* MEMMAP_H_ */
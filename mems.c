@@ -16,6 +16,10 @@
 #include "lis302dl.h"
 
 #include "mems.h"
+#include "memmap.h"
+#include "trace.h"
+#include "metrics.h"
+#include "timing.h"
 #include "command.h"
 
 BaseSequentialStream *memsSequentialStream;
@@ -36,29 +40,70 @@ static const SPIConfig memsSPI1Cfg = {
 
 void memsInit(BaseSequentialStream *stream){
   spiStart(&SPID1, &memsSPI1Cfg);
-  lis302dlWriteRegister(&SPID1, LIS302DL_CTRL_REG1, 0x43);
-  lis302dlWriteRegister(&SPID1, LIS302DL_CTRL_REG2, 0x00);
-  lis302dlWriteRegister(&SPID1, LIS302DL_CTRL_REG3, 0x00);
   memsSequentialStream = stream;
 }
 
+static MemsStats memsStats;
+
+METRIC_COUNTER(memsSamples, "mems.samples", "");
+METRIC_COUNTER(memsLost, "mems.lost", "");
+METRIC_HISTOGRAM(memsSpiTime, "mems.spi_us", "us");
+METRIC_HISTOGRAM(memsJitter, "mems.jitter_us", "us");
+TIMING_SITE(memsReadTiming, "mems.lis302dl_read");
+TIMING_SITE(memsPrintTiming, "mems.chprintf");
+static const uint32_t memsJitterBins[MEMS_JITTER_NBINS - 1] = MEMS_JITTER_BINS;
+
+static uint32_t mems_us(halrtcnt_t ticks) {
+  return ticks / (halGetCounterFrequency() / 1000000);
+}
+
+static void mems_stats_clear(void) {
+  chSysLock();
+  memset(&memsStats, 0, sizeof(memsStats));
+  memsStats.intmin = 0xFFFFFFFF;
+  memsStats.spimin = 0xFFFFFFFF;
+  chSysUnlock();
+}
+
+/*
+ * Interval between the starts of two periods, in us.
+ */
+static void mems_interval(uint32_t us) {
+  uint32_t dev, i;
+
+  dev = us > MEMS_PERIOD_MS * 1000 ? us - MEMS_PERIOD_MS * 1000 : MEMS_PERIOD_MS * 1000 - us;
+  for (i = 0; i < MEMS_JITTER_NBINS - 1 && dev >= memsJitterBins[i]; i++)
+    ;
+  memsStats.jitter[i]++;
+  memsStats.intmin = us < memsStats.intmin ? us : memsStats.intmin;
+  memsStats.intmax = us > memsStats.intmax ? us : memsStats.intmax;
+  memsStats.intsum += us;
+  memsStats.intcount++;
+  metricObserve(&memsJitter, dev);
+}
+
 /*
  * This is a periodic thread that reads accelerometer and save
  * the result on memsX and memsY
  */
-static WORKING_AREA(memsThreadWA, 128);
+/* In SRAM, the SPI exchanges may be given stack buffers.*/
+static WORKING_AREA(memsThreadWA, 256);
 static msg_t memsThread(void *arg) {
-  static int8_t xbuf[4], ybuf[4];   /* Last accelerometer data.*/
+  static CCM_DATA int8_t xbuf[4], ybuf[4];   /* Last accelerometer data.*/
   systime_t time;                   /* Next deadline.*/
+  halrtcnt_t start, last = 0;
+  uint32_t us;
   static int32_t counter=0;
   
   (void)arg;
   chRegSetThreadName("Accelerometer");
   
-  /* LIS302DL initialization.*/
+  /* LIS302DL initialization, here rather than in memsInit() so that it
+     runs alongside the rest of the boot.*/
   lis302dlWriteRegister(&SPID1, LIS302DL_CTRL_REG1, 0x43);
   lis302dlWriteRegister(&SPID1, LIS302DL_CTRL_REG2, 0x00);
   lis302dlWriteRegister(&SPID1, LIS302DL_CTRL_REG3, 0x00);
+  bootMark(BOOT_MEMS_CONFIG);
   
   /* Reader thread loop.*/
   time = chTimeNow();
@@ -66,39 +111,73 @@ static msg_t memsThread(void *arg) {
     unsigned i;
     
     counter++;
+    start = halGetCounterValue();
+    metricInc(memsSamples);
+    if (memsStats.samples++ > 0)
+      mems_interval(mems_us(start - last));
+    last = start;
     
-    if(SPID1.state != SPI_READY)
-      continue;
-    
-    /* Keeping an history of the latest four accelerometer readings.*/
-    for (i = 3; i > 0; i--) {
-      xbuf[i] = xbuf[i - 1];
-      ybuf[i] = ybuf[i - 1];
+    if(SPID1.state == SPI_READY) {
+      /* Keeping an history of the latest four accelerometer readings.*/
+      for (i = 3; i > 0; i--) {
+        xbuf[i] = xbuf[i - 1];
+        ybuf[i] = ybuf[i - 1];
+      }
+      
+      /* Reading MEMS accelerometer X and Y registers.*/
+      TRACE(TRACE_EV_SPI_BEGIN, 2, 0);
+      TIMING(memsReadTiming,
+             xbuf[0] = (int8_t)lis302dlReadRegister(&SPID1, LIS302DL_OUTX);
+             ybuf[0] = (int8_t)lis302dlReadRegister(&SPID1, LIS302DL_OUTY));
+      TRACE(TRACE_EV_SPI_END, 0, 0);
+      us = mems_us(halGetCounterValue() - start);
+      memsStats.spimin = us < memsStats.spimin ? us : memsStats.spimin;
+      memsStats.spimax = us > memsStats.spimax ? us : memsStats.spimax;
+      memsStats.spisum += us;
+      memsStats.spicount++;
+      metricObserve(&memsSpiTime, us);
+      bootMark(BOOT_FIRST_SAMPLE);
+      
+      /* Calculating average of the latest four accelerometer readings.*/
+      memsX = ((int32_t)xbuf[0] + (int32_t)xbuf[1] +
+              (int32_t)xbuf[2] + (int32_t)xbuf[3]) / 4;
+      memsY = ((int32_t)ybuf[0] + (int32_t)ybuf[1] +
+              (int32_t)ybuf[2] + (int32_t)ybuf[3]) / 4;
+    }
+    else {
+      /* Another user has the bus, this sample is lost but the period is
+         kept, retrying at once would spin at this priority.*/
+      memsStats.spibusy++;
+      memsStats.lost++;
+      metricInc(memsLost);
     }
-    
-    /* Reading MEMS accelerometer X and Y registers.*/
-    xbuf[0] = (int8_t)lis302dlReadRegister(&SPID1, LIS302DL_OUTX);
-    ybuf[0] = (int8_t)lis302dlReadRegister(&SPID1, LIS302DL_OUTY);
-    
-    /* Calculating average of the latest four accelerometer readings.*/
-    memsX = ((int32_t)xbuf[0] + (int32_t)xbuf[1] +
-            (int32_t)xbuf[2] + (int32_t)xbuf[3]) / 4;
-    memsY = ((int32_t)ybuf[0] + (int32_t)ybuf[1] +
-            (int32_t)ybuf[2] + (int32_t)ybuf[3]) / 4;
     if(counter%10 == 0) {
       palTogglePad(GPIOD, GPIOD_LED5);
       if(cmdGetDebug())
-        chprintf(memsSequentialStream, "X:%d, Y:%d\r\n", memsX, memsY);
+        TIMING(memsPrintTiming,
+               chprintf(memsSequentialStream, "X:%d, Y:%d\r\n", memsX, memsY));
     }
     if(counter==1000000)
       counter=0;
-    /* Waiting until the next 100 milliseconds time interval.*/
-    chThdSleepUntil(time += MS2ST(100));
+    /* Waiting until the next period. A deadline already past would make
+       chThdSleepUntil() wait for the system time to wrap, the periods
+       missed are skipped instead.*/
+    time += MS2ST(MEMS_PERIOD_MS);
+    if ((systime_t)(time - chTimeNow()) > MS2ST(MEMS_PERIOD_MS)) {
+      memsStats.missed++;
+      do {
+        time += MS2ST(MEMS_PERIOD_MS);
+        memsStats.lost++;
+        metricInc(memsLost);
+      } while ((systime_t)(time - chTimeNow()) > MS2ST(MEMS_PERIOD_MS));
+    }
+    chThdSleepUntil(time);
   }
   return (msg_t)NULL;
 }
 
 void memsStart(void){
+  mems_stats_clear();
   /*
    * Creates the Accelarator thread.
    */
@@ -114,3 +193,38 @@ int32_t memsGetY(void){
   return memsY;
 }
 
+const MemsStats *memsGetStats(void){
+  return &memsStats;
+}
+
+void cmd_memsstat(BaseSequentialStream *chp, int argc, char *argv[]) {
+  static const char *bins[MEMS_JITTER_NBINS] = {
+    "<10us", "<50us", "<100us", "<500us", "<1ms", "<5ms", ">=5ms"
+  };
+  MemsStats stats;
+  uint32_t i;
+  if (argc > 1 || (argc == 1 && strcmp(argv[0], "reset") != 0)) {
+    chprintf(chp, "Usage: memsstat [reset]\r\n");
+    chprintf(chp, "       Accelerometer sampling timing, every %u ms\r\n", MEMS_PERIOD_MS);
+    return;
+  }
+  if (argc == 1) {
+    mems_stats_clear();
+    return;
+  }
+  chSysLock();
+  stats = memsStats;
+  chSysUnlock();
+  chprintf(chp, "samples  : %lu, %lu lost (%lu SPI busy), %lu deadlines missed\r\n",
+           stats.samples, stats.lost, stats.spibusy, stats.missed);
+  if (stats.intcount > 0)
+    chprintf(chp, "interval : %lu min, %lu avg, %lu max us\r\n", stats.intmin,
+             (uint32_t)(stats.intsum / stats.intcount), stats.intmax);
+  if (stats.spicount > 0)
+    chprintf(chp, "SPI read : %lu min, %lu avg, %lu max us\r\n", stats.spimin,
+             (uint32_t)(stats.spisum / stats.spicount), stats.spimax);
+  chprintf(chp, "jitter   :");
+  for (i = 0; i < MEMS_JITTER_NBINS; i++)
+    chprintf(chp, " %s %lu", bins[i], stats.jitter[i]);
+  chprintf(chp, "\r\n");
+}
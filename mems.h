@@ -9,7 +9,42 @@
 #ifndef ____mems__
 #define ____mems__
 
+/**
+ * @brief   Accelerometer sampling period.
+ */
+#if !defined(MEMS_PERIOD_MS)
+#define MEMS_PERIOD_MS      100
+#endif
+
+/**
+ * @brief   Bins of the sample interval histogram, by deviation from the
+ *          period in microseconds. The last bin takes everything above.
+ */
+#define MEMS_JITTER_BINS    {10, 50, 100, 500, 1000, 5000}
+#define MEMS_JITTER_NBINS   7
+
+/**
+ * @brief   Acquisition timing.
+ */
+typedef struct {
+  uint32_t samples;         /* Periods run.                                 */
+  uint32_t missed;          /* Deadlines found already past.                */
+  uint32_t lost;            /* Samples skipped, late or SPI busy.           */
+  uint32_t spibusy;         /* Samples skipped because SPI1 was in use.     */
+  uint32_t intmin;          /* Sample interval, us.                         */
+  uint32_t intmax;
+  uint64_t intsum;
+  uint32_t intcount;
+  uint32_t jitter[MEMS_JITTER_NBINS];
+  uint32_t spimin;          /* Duration of the X and Y reads, us.           */
+  uint32_t spimax;
+  uint64_t spisum;
+  uint32_t spicount;
+} MemsStats;
+
 void memsInit(BaseSequentialStream *);
 void memsStart(void);
+const MemsStats *memsGetStats(void);
+void cmd_memsstat(BaseSequentialStream *chp, int argc, char *argv[]);
 
 #endif /* defined(____mems__) */
@@ -0,0 +1,206 @@
+/*
+ * metrics.c
+ *
+ *  Named counters, gauges and histograms collected from all modules.
+ *
+ *  Modules define their metrics with METRIC_COUNTER(), METRIC_GAUGE() and
+ *  METRIC_HISTOGRAM() and update them with atomic adds, no lock is taken.
+ *  The descriptors are const and gathered by the linker, stats walks them.
+ *
+ *  stats bin writes them in binary for host tools (tools/metrics.py), all
+ *  integers little endian:
+ *
+ *    "MTR2", uint16 count, then count times:
+ *      uint8 type, uint8 name length, name, uint8 unit length, unit,
+ *      uint32 value for counters and gauges, or
+ *      uint32 buckets[METRIC_BUCKETS], sum low, sum high for histograms, or
+ *      uint32 count, min, max, sum low, sum high, buckets[TIMING_BUCKETS]
+ *      for timing sites.
+ */
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+
+#include "metrics.h"
+#include "timing.h"
+
+/* Linker script symbols, see ccm.ld.*/
+extern const Metric __metrics_start__[], __metrics_end__[];
+
+const Metric *metricFirst(void) {
+	return __metrics_start__;
+}
+
+const Metric *metricEnd(void) {
+	return __metrics_end__;
+}
+
+static uint32_t metric_bound(uint32_t i, uint32_t n) {
+	return i == n - 1 ? 0xFFFFFFFF : (1U << i) - 1;
+}
+
+/*
+ * Upper bound of the bucket holding the given fraction of the values.
+ */
+static uint32_t metric_quantile(const volatile uint32_t *buckets, uint32_t n,
+		uint32_t count, uint32_t permille) {
+	uint32_t i, seen = 0, rank = (uint32_t)((uint64_t)count * permille / 1000);
+
+	for (i = 0; i < n - 1; i++) {
+		seen += buckets[i];
+		if (seen > rank) {
+			break;
+		}
+	}
+	return metric_bound(i, n);
+}
+
+/*
+ * The 64 bit sum of a histogram, read with interrupts masked.
+ */
+static uint64_t metric_sum(const MetricHistogram *hp) {
+	uint32_t primask = __get_PRIMASK();
+	uint64_t sum;
+
+	__disable_irq();
+	sum = hp->sum;
+	__set_PRIMASK(primask);
+	return sum;
+}
+
+/*
+ * Copy of a timing site with interrupts masked, timingRecord() updates its
+ * fields together and the sum takes two stores.
+ */
+static void metric_timing(const TimingSite *tsp, TimingSite *snap) {
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	*snap = *tsp;
+	__set_PRIMASK(primask);
+}
+
+static uint32_t metric_max(const volatile uint32_t *buckets, uint32_t n) {
+	uint32_t i = n - 1;
+
+	while (i > 0 && buckets[i] == 0) {
+		i--;
+	}
+	return metric_bound(i, n);
+}
+
+void metricPrint(BaseSequentialStream *chp, const Metric *mp) {
+	const MetricHistogram *hp;
+	TimingSite ts;
+	uint32_t i, count;
+
+	switch (mp->type) {
+	case METRIC_TYPE_HISTOGRAM:
+		hp = (const MetricHistogram *)mp->value;
+		for (i = 0, count = 0; i < METRIC_BUCKETS; i++) {
+			count += hp->buckets[i];
+		}
+		chprintf(chp, "%-20s %10lu samples", mp->name, count);
+		if (count > 0) {
+			chprintf(chp, ", avg %lu, p50 <= %lu, p99 <= %lu, max <= %lu %s",
+				(uint32_t)(metric_sum(hp) / count),
+				metric_quantile(hp->buckets, METRIC_BUCKETS, count, 500),
+				metric_quantile(hp->buckets, METRIC_BUCKETS, count, 990),
+				metric_max(hp->buckets, METRIC_BUCKETS), mp->unit);
+		}
+		chprintf(chp, "\r\n");
+		break;
+	case METRIC_TYPE_TIMING:
+		metric_timing((const TimingSite *)mp->value, &ts);
+		chprintf(chp, "%-20s %10lu calls", mp->name, ts.count);
+		if (ts.count > 0) {
+			chprintf(chp, ", min %lu, avg %lu, p99 <= %lu, max %lu %s",
+				ts.min, (uint32_t)(ts.sum / ts.count),
+				metric_quantile(ts.buckets, TIMING_BUCKETS, ts.count, 990),
+				ts.max, mp->unit);
+		}
+		chprintf(chp, "\r\n");
+		break;
+	default:
+		chprintf(chp, "%-20s %10lu %s\r\n", mp->name,
+			*(volatile uint32_t *)mp->value, mp->unit);
+	}
+}
+
+static void metric_write_string(BaseSequentialStream *chp, const char *s) {
+	uint8_t n = (uint8_t)strlen(s);
+
+	chSequentialStreamWrite(chp, &n, 1);
+	chSequentialStreamWrite(chp, (const uint8_t *)s, n);
+}
+
+static void metric_write_u32(BaseSequentialStream *chp, uint32_t v) {
+	/* Little endian core, the value is written as is.*/
+	chSequentialStreamWrite(chp, (const uint8_t *)&v, 4);
+}
+
+static void metric_dump(BaseSequentialStream *chp) {
+	const Metric *mp;
+	const MetricHistogram *hp;
+	TimingSite ts;
+	uint16_t count = (uint16_t)(metricEnd() - metricFirst());
+	uint8_t type;
+	uint32_t i;
+	uint64_t sum;
+
+	chSequentialStreamWrite(chp, (const uint8_t *)"MTR2", 4);
+	chSequentialStreamWrite(chp, (const uint8_t *)&count, 2);
+	for (mp = metricFirst(); mp < metricEnd(); mp++) {
+		type = (uint8_t)mp->type;
+		chSequentialStreamWrite(chp, &type, 1);
+		metric_write_string(chp, mp->name);
+		metric_write_string(chp, mp->unit);
+		switch (mp->type) {
+		case METRIC_TYPE_HISTOGRAM:
+			hp = (const MetricHistogram *)mp->value;
+			for (i = 0; i < METRIC_BUCKETS; i++) {
+				metric_write_u32(chp, hp->buckets[i]);
+			}
+			sum = metric_sum(hp);
+			metric_write_u32(chp, (uint32_t)sum);
+			metric_write_u32(chp, (uint32_t)(sum >> 32));
+			break;
+		case METRIC_TYPE_TIMING:
+			metric_timing((const TimingSite *)mp->value, &ts);
+			metric_write_u32(chp, ts.count);
+			metric_write_u32(chp, ts.min);
+			metric_write_u32(chp, ts.max);
+			metric_write_u32(chp, (uint32_t)ts.sum);
+			metric_write_u32(chp, (uint32_t)(ts.sum >> 32));
+			for (i = 0; i < TIMING_BUCKETS; i++) {
+				metric_write_u32(chp, ts.buckets[i]);
+			}
+			break;
+		default:
+			metric_write_u32(chp, *(volatile uint32_t *)mp->value);
+		}
+	}
+}
+
+void cmd_stats(BaseSequentialStream *chp, int argc, char *argv[]) {
+	const Metric *mp;
+	if (argc > 1) {
+		chprintf(chp, "Usage: stats [prefix|bin]\r\n");
+		chprintf(chp, "       Prints the metrics whose name starts with [prefix]\r\n");
+		chprintf(chp, "       bin dumps all of them in binary, see tools/metrics.py\r\n");
+		return;
+	}
+	if (argc == 1 && strcmp(argv[0], "bin") == 0) {
+		metric_dump(chp);
+		return;
+	}
+	for (mp = metricFirst(); mp < metricEnd(); mp++) {
+		if (argc == 0 || strncmp(mp->name, argv[0], strlen(argv[0])) == 0) {
+			metricPrint(chp, mp);
+		}
+	}
+}
@@ -0,0 +1,93 @@
+/*
+ * metrics.h
+ *
+ *  Named counters, gauges and histograms collected from all modules.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+/**
+ * @brief   Histogram buckets, bucket i counts the values of i bits, from
+ *          2^(i-1) to 2^i - 1. The last one takes everything above.
+ */
+#define METRIC_BUCKETS          32
+
+/**
+ * @brief   Metric kinds.
+ */
+typedef enum {
+  METRIC_TYPE_COUNTER = 0,
+  METRIC_TYPE_GAUGE,
+  METRIC_TYPE_HISTOGRAM,
+  METRIC_TYPE_TIMING        /* TimingSite, see timing.h.                    */
+} metrictype_t;
+
+/**
+ * @brief   Histogram storage.
+ */
+typedef struct {
+  volatile uint32_t buckets[METRIC_BUCKETS];
+  volatile uint64_t sum;
+} MetricHistogram;
+
+/**
+ * @brief   Metric descriptor, in flash.
+ */
+typedef struct {
+  const char *name;
+  const char *unit;
+  uint32_t type;
+  volatile void *value;
+} Metric;
+
+/* Also used by timing.h.*/
+#define _METRIC_DESCRIPTOR(var, name, unit, type)                           \
+  static const Metric var##_metric                                          \
+    __attribute__((section(".metrics"), used)) = {name, unit, type, &var}
+
+/**
+ * @brief   Defines a metric and registers it, at file scope. Descriptors
+ *          are gathered by the linker (ccm.ld), there is no init call.
+ */
+#define METRIC_COUNTER(var, name, unit)                                     \
+  static volatile uint32_t var;                                             \
+  _METRIC_DESCRIPTOR(var, name, unit, METRIC_TYPE_COUNTER)
+#define METRIC_GAUGE(var, name, unit)                                       \
+  static volatile uint32_t var;                                             \
+  _METRIC_DESCRIPTOR(var, name, unit, METRIC_TYPE_GAUGE)
+#define METRIC_HISTOGRAM(var, name, unit)                                   \
+  static MetricHistogram var;                                               \
+  _METRIC_DESCRIPTOR(var, name, unit, METRIC_TYPE_HISTOGRAM)
+
+/**
+ * @brief   Adds to a counter, lock free, callable from interrupts.
+ */
+static inline void metricAdd(volatile uint32_t *p, uint32_t n) {
+  do {
+  } while (__STREXW(__LDREXW(p) + n, p) != 0);
+}
+
+#define metricInc(var)          metricAdd(&(var), 1)
+#define metricSet(var, v)       ((var) = (v))
+
+/**
+ * @brief   Counts a value in its power of two bucket, callable from
+ *          interrupts. The 64 bit sum is updated with interrupts masked.
+ */
+static inline void metricObserve(MetricHistogram *hp, uint32_t v) {
+  uint32_t i = v == 0 ? 0 : 32 - __CLZ(v);
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  hp->buckets[i < METRIC_BUCKETS ? i : METRIC_BUCKETS - 1]++;
+  hp->sum += v;
+  __set_PRIMASK(primask);
+}
+
+const Metric *metricFirst(void);
+const Metric *metricEnd(void);
+void metricPrint(BaseSequentialStream *chp, const Metric *mp);
+void cmd_stats(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* METRICS_H_ */
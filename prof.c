@@ -0,0 +1,141 @@
+/*
+ * prof.c
+ *
+ *  Sampling PC profiler driven by TIM7.
+ *
+ *  The TIM7 update interrupt reads the PC the CPU was interrupted at from
+ *  the exception frame and counts it in a hash table, optionally keyed by
+ *  the LR too. The LR is the caller in leaf functions and right after a
+ *  call, later it may already hold something else, it is a hint.
+ *
+ *  prof dump prints the table, tools/prof.py resolves the addresses
+ *  against build/ch.elf and prints a flat profile or folded stacks.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+
+#include "prof.h"
+
+static ProfEntry profTable[PROF_SLOTS];
+static uint32_t profSamples;        /* Samples taken.*/
+static uint32_t profDropped;        /* Samples not counted, table full.*/
+static uint32_t profHz;
+static bool_t profLr;
+static bool_t profRunning;
+
+/*
+ * From the TIM7 handler, frame is the exception stack frame: r0-r3, r12,
+ * lr, pc, xpsr.
+ */
+void profSample(uint32_t *frame) {
+	uint32_t pc = frame[6];
+	uint32_t lr = profLr ? frame[5] & ~1U : 0;
+	uint32_t i, n, h;
+
+	TIM7->SR = 0;
+	profSamples++;
+	h = ((pc ^ lr) >> 1) * 2654435761U;
+	for (n = 0; n < 8; n++) {
+		i = (h + n) & (PROF_SLOTS - 1);
+		if (profTable[i].count == 0) {
+			profTable[i].pc = pc;
+			profTable[i].lr = lr;
+		} else if (profTable[i].pc != pc || profTable[i].lr != lr) {
+			continue;
+		}
+		profTable[i].count++;
+		return;
+	}
+	profDropped++;
+}
+
+/*
+ * Picks the stack the interrupted code was using and tail calls
+ * profSample(), which returns from the exception.
+ */
+void STM32_TIM7_HANDLER(void) __attribute__((naked));
+void STM32_TIM7_HANDLER(void) {
+	asm volatile (
+		"tst   lr, #4      \n"
+		"ite   eq          \n"
+		"mrseq r0, msp     \n"
+		"mrsne r0, psp     \n"
+		"b     profSample  \n"
+	);
+}
+
+void profStart(uint32_t hz, bool_t lr) {
+	profStop();
+	memset(profTable, 0, sizeof(profTable));
+	profSamples = 0;
+	profDropped = 0;
+	profHz = hz;
+	profLr = lr;
+	RCC->APB1ENR |= RCC_APB1ENR_TIM7EN;
+	RCC->APB1RSTR |= RCC_APB1RSTR_TIM7RST;
+	RCC->APB1RSTR &= ~RCC_APB1RSTR_TIM7RST;
+	/* 1MHz count.*/
+	TIM7->PSC = STM32_TIMCLK1 / 1000000 - 1;
+	TIM7->ARR = 1000000 / hz - 1;
+	TIM7->CR1 = TIM_CR1_URS;
+	TIM7->EGR = 1;
+	TIM7->SR = 0;
+	TIM7->DIER = TIM_DIER_UIE;
+	nvicEnableVector(STM32_TIM7_NUMBER, CORTEX_PRIORITY_MASK(PROF_IRQ_PRIORITY));
+	TIM7->CR1 |= TIM_CR1_CEN;
+	profRunning = TRUE;
+}
+
+void profStop(void) {
+	if (!profRunning) {
+		return;
+	}
+	TIM7->CR1 = 0;
+	TIM7->DIER = 0;
+	nvicDisableVector(STM32_TIM7_NUMBER);
+	RCC->APB1ENR &= ~RCC_APB1ENR_TIM7EN;
+	profRunning = FALSE;
+}
+
+void cmd_prof(BaseSequentialStream *chp, int argc, char *argv[]) {
+	uint32_t i, hz, used = 0;
+	if (argc < 1) {
+		for (i = 0; i < PROF_SLOTS; i++) {
+			used += profTable[i].count > 0;
+		}
+		chprintf(chp, "%s, %lu Hz, %lu samples, %lu dropped, %lu of %u slots\r\n",
+			profRunning ? "running" : "stopped", profHz, profSamples, profDropped,
+			used, PROF_SLOTS);
+		chprintf(chp, "Usage: prof start [Hz] [lr]|stop|dump\r\n");
+		return;
+	}
+	if (strcmp(argv[0], "start") == 0) {
+		hz = argc > 1 ? (uint32_t)atoi(argv[1]) : PROF_DEFAULT_HZ;
+		if (hz < 16 || hz > 100000) {
+			chprintf(chp, "prof: rate from 16 to 100000 Hz\r\n");
+			return;
+		}
+		profStart(hz, argc > 2 && strcmp(argv[2], "lr") == 0);
+	} else if (strcmp(argv[0], "stop") == 0) {
+		profStop();
+	} else if (strcmp(argv[0], "dump") == 0) {
+		/* Stopped meanwhile, the table would change under the dump.*/
+		profStop();
+		chprintf(chp, "# prof %lu Hz %lu samples %lu dropped\r\n",
+			profHz, profSamples, profDropped);
+		for (i = 0; i < PROF_SLOTS; i++) {
+			if (profTable[i].count > 0) {
+				chprintf(chp, "P,%.8lx,%.8lx,%lu\r\n", profTable[i].pc,
+					profTable[i].lr, profTable[i].count);
+			}
+		}
+	} else {
+		chprintf(chp, "Usage: prof start [Hz] [lr]|stop|dump\r\n");
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * prof.h
+ *
+ *  Sampling PC profiler driven by TIM7.
+ */
+
+#ifndef PROF_H_
+#define PROF_H_
+
+/**
+ * @brief   Distinct sampled addresses kept, a power of two.
+ */
+#if !defined(PROF_SLOTS)
+#define PROF_SLOTS              512
+#endif
+
+/**
+ * @brief   Default sampling rate, prime so that it does not lock onto the
+ *          1kHz system tick.
+ */
+#if !defined(PROF_DEFAULT_HZ)
+#define PROF_DEFAULT_HZ         997
+#endif
+
+/**
+ * @brief   TIM7 interrupt priority, above the kernel so that critical
+ *          sections are sampled too. The handler calls no kernel API.
+ */
+#if !defined(PROF_IRQ_PRIORITY)
+#define PROF_IRQ_PRIORITY       0
+#endif
+
+/**
+ * @brief   Profile entry, samples of one PC (and caller when recorded).
+ */
+typedef struct {
+  uint32_t pc;
+  uint32_t lr;
+  uint32_t count;
+} ProfEntry;
+
+void profStart(uint32_t hz, bool_t lr);
+void profStop(void);
+void cmd_prof(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* PROF_H_ */
@@ -0,0 +1,123 @@
+/*
+ * ramdisk.c
+ *
+ *  Memory backed block device, FatFs volume 1.
+ *
+ *  Bursts are staged here and copied to the SD card later in long
+ *  sequential writes, out of the way of the card latency spikes. Nothing
+ *  in this file depends on the RTOS so that the same volume serves FatFs
+ *  throughput tests on a host. Accesses are serialized by the FatFs
+ *  volume lock.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ffconf.h"
+#include "diskio.h"
+
+#include "ramdisk.h"
+
+#define RAMDISK_SECTOR_SIZE     512
+
+static RAMDISK_SECTION uint32_t ramdiskMemory[RAMDISK_SLOTS * RAMDISK_SECTOR_SIZE / sizeof(uint32_t)];
+
+/*
+ * Sector to memory slot map, slot + 1 or zero for a sector reading as
+ * zeros, and the stack of free slots.
+ */
+static uint16_t ramdiskMap[RAMDISK_SECTORS];
+static uint16_t ramdiskFree[RAMDISK_SLOTS];
+static uint32_t ramdiskFreeCount;
+
+static RamdiskStats ramdiskStats;
+
+static uint8_t *ramdisk_slot(uint32_t slot) {
+	return (uint8_t *)ramdiskMemory + (slot - 1) * RAMDISK_SECTOR_SIZE;
+}
+
+static void ramdisk_unmap(uint32_t sector) {
+	if (ramdiskMap[sector] != 0) {
+		ramdiskFree[ramdiskFreeCount++] = ramdiskMap[sector];
+		ramdiskMap[sector] = 0;
+		ramdiskStats.used--;
+	}
+}
+
+static int ramdisk_is_zero(const BYTE *buff) {
+	const BYTE *end = buff + RAMDISK_SECTOR_SIZE;
+
+	while (buff < end) {
+		if (*buff++ != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Releases all the memory, the volume reads as zeros (no file system).
+ */
+void ramdiskInit(void) {
+	uint32_t i;
+
+	memset(ramdiskMap, 0, sizeof(ramdiskMap));
+	for (i = 0; i < RAMDISK_SLOTS; i++) {
+		ramdiskFree[i] = RAMDISK_SLOTS - i;
+	}
+	ramdiskFreeCount = RAMDISK_SLOTS;
+	memset(&ramdiskStats, 0, sizeof(ramdiskStats));
+}
+
+DRESULT ramdiskRead(BYTE *buff, DWORD sector, UINT count) {
+	if (sector + count > RAMDISK_SECTORS) {
+		return RES_PARERR;
+	}
+	ramdiskStats.reads++;
+	for (; count > 0; count--, sector++, buff += RAMDISK_SECTOR_SIZE) {
+		if (ramdiskMap[sector] != 0) {
+			memcpy(buff, ramdisk_slot(ramdiskMap[sector]), RAMDISK_SECTOR_SIZE);
+		} else {
+			memset(buff, 0, RAMDISK_SECTOR_SIZE);
+		}
+	}
+	return RES_OK;
+}
+
+DRESULT ramdiskWrite(const BYTE *buff, DWORD sector, UINT count) {
+	if (sector + count > RAMDISK_SECTORS) {
+		return RES_PARERR;
+	}
+	ramdiskStats.writes++;
+	for (; count > 0; count--, sector++, buff += RAMDISK_SECTOR_SIZE) {
+		if (ramdisk_is_zero(buff)) {
+			ramdisk_unmap(sector);
+			continue;
+		}
+		if (ramdiskMap[sector] == 0) {
+			if (ramdiskFreeCount == 0) {
+				ramdiskStats.full++;
+				return RES_ERROR;
+			}
+			ramdiskMap[sector] = ramdiskFree[--ramdiskFreeCount];
+			if (++ramdiskStats.used > ramdiskStats.peak) {
+				ramdiskStats.peak = ramdiskStats.used;
+			}
+		}
+		memcpy(ramdisk_slot(ramdiskMap[sector]), buff, RAMDISK_SECTOR_SIZE);
+	}
+	return RES_OK;
+}
+
+/*
+ * Freed clusters give their memory back.
+ */
+void ramdiskTrim(DWORD start, DWORD end) {
+	for (; start <= end && start < RAMDISK_SECTORS; start++) {
+		ramdisk_unmap(start);
+	}
+}
+
+const RamdiskStats *ramdiskGetStats(void) {
+	return &ramdiskStats;
+}
@@ -0,0 +1,63 @@
+/*
+ * ramdisk.h
+ *
+ *  Memory backed block device, FatFs volume 1.
+ */
+
+#ifndef RAMDISK_H_
+#define RAMDISK_H_
+
+#include "diskio.h"
+
+/**
+ * @brief   FatFs drive number of the RAM disk.
+ */
+#define RAMDISK_DRIVE           1
+
+/**
+ * @brief   Sectors advertised to FatFs.
+ * @note    f_mkfs() needs at least 128.
+ */
+#if !defined(RAMDISK_SECTORS)
+#define RAMDISK_SECTORS         256
+#endif
+
+/**
+ * @brief   Sectors of backing memory.
+ * @details Sectors are mapped to memory on the first non zero write, the
+ *          empty root directory and FAT space cost nothing so a volume
+ *          larger than its memory can be formatted. Writes fail when the
+ *          memory is full.
+ */
+#if !defined(RAMDISK_SLOTS)
+#define RAMDISK_SLOTS           96
+#endif
+
+/**
+ * @brief   Placement of the backing memory.
+ * @details Defaults to the CCM of the STM32F407 (see memmap.h), not
+ *          reachable by DMA, which the RAM disk does not need as it copies
+ *          with the CPU. A host build defines it empty.
+ */
+#if !defined(RAMDISK_SECTION)
+#define RAMDISK_SECTION         __attribute__((section(".ccm")))
+#endif
+
+/**
+ * @brief   RAM disk counters.
+ */
+typedef struct {
+  uint32_t used;            /* Mapped sectors.                              */
+  uint32_t peak;
+  uint32_t reads;
+  uint32_t writes;
+  uint32_t full;            /* Writes failed for lack of memory.            */
+} RamdiskStats;
+
+void ramdiskInit(void);
+DRESULT ramdiskRead(BYTE *buff, DWORD sector, UINT count);
+DRESULT ramdiskWrite(const BYTE *buff, DWORD sector, UINT count);
+void ramdiskTrim(DWORD start, DWORD end);
+const RamdiskStats *ramdiskGetStats(void);
+
+#endif /* RAMDISK_H_ */
@@ -0,0 +1,432 @@
+/*
+ * rawlog.c
+ *
+ *  Raw sector logging into a reserved, contiguous and FAT visible region.
+ *
+ *  The region is a regular file (RAWLOG_FILENAME) preallocated right after
+ *  mkfs so that its clusters are contiguous. Once its first sector is known
+ *  the log blocks are streamed with multi-block sdcWrite() calls, bypassing
+ *  the FatFs sector window, the FAT and the directory entry entirely. A PC
+ *  reading the card still sees the data as the content of the file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+
+#include "fat.h"
+#include "disk.h"
+#include "fspool.h"
+#include "shell.h"
+#include "jobs.h"
+#include "memmap.h"
+#include "rawlog.h"
+
+/*
+ * State of the open region.
+ */
+static struct {
+	bool_t open;
+	uint32_t start;		/* First sector of the region (header sector).	*/
+	uint32_t sectors;	/* Sectors in the region, header included.	*/
+	uint32_t next;		/* Next data block to write, from data start.	*/
+	uint32_t fill;		/* Bytes queued in the multi-block buffer.	*/
+	RawLogHeader header;
+} rawlog;
+
+/*
+ * Serializes the users of the state and of the buffers below, cmd_rawlog
+ * holds it for a whole command so that a bench job and a close from the
+ * shell do not interleave.
+ */
+static MUTEX_DECL(rawlogMtx);
+
+/*
+ * Multi-block write buffer and header sector, word aligned for the SDIO DMA.
+ */
+static uint32_t rawlogBuffer[RAWLOG_BUFFER_BLOCKS * MMCSD_BLOCK_SIZE / sizeof(uint32_t)];
+static uint32_t rawlogHeaderBlock[MMCSD_BLOCK_SIZE / sizeof(uint32_t)];
+
+/*
+ * Find the first sector and the size of the region, fails if the file is
+ * not made of a single run of clusters.
+ */
+static FRESULT rawlog_locate(uint32_t *start, uint32_t *sectors) {
+	FIL *fil;
+	DWORD clmt[4];
+	FATFS *fs;
+	FRESULT err;
+
+	fil = fsFileAlloc();
+	if (fil == NULL) {
+		return FR_NOT_ENOUGH_CORE;
+	}
+	err = f_open(fil, RAWLOG_FILENAME, FA_READ);
+	if (err != FR_OK) {
+		fsFileFree(fil);
+		return err;
+	}
+	/*
+	 * Build the cluster link map, a contiguous file is a single fragment:
+	 * {table size, cluster count, first cluster, terminator}.
+	 */
+	clmt[0] = sizeof(clmt) / sizeof(clmt[0]);
+	fil->cltbl = clmt;
+	err = f_lseek(fil, CREATE_LINKMAP);
+	fs = fil->fs;
+	if (err == FR_NOT_ENOUGH_CORE) {
+		err = FR_DENIED;
+	} else if (err == FR_OK) {
+		if (f_size(fil) < 2 * MMCSD_BLOCK_SIZE ||
+				clmt[1] * fs->csize * MMCSD_BLOCK_SIZE < f_size(fil)) {
+			err = FR_DENIED;
+		} else {
+			*start = fs->database + (clmt[2] - 2) * fs->csize;
+			*sectors = f_size(fil) / MMCSD_BLOCK_SIZE;
+		}
+	}
+	fil->cltbl = NULL;
+	f_close(fil);
+	fsFileFree(fil);
+	return err;
+}
+
+/*
+ * Raw transfers share the SDC driver with FatFs.
+ */
+static FRESULT rawlog_transfer(bool_t write, uint32_t sector, uint8_t *buf, uint32_t n) {
+	bool_t err;
+
+	if (write) {
+		err = diskWrite(sector, buf, n);
+	} else {
+		err = diskRead(sector, buf, n);
+	}
+	return err ? FR_DISK_ERR : FR_OK;
+}
+
+static FRESULT rawlog_write_header(void) {
+	memset(rawlogHeaderBlock, 0, sizeof(rawlogHeaderBlock));
+	memcpy(rawlogHeaderBlock, &rawlog.header, sizeof(rawlog.header));
+	return rawlog_transfer(TRUE, rawlog.start, (uint8_t *)rawlogHeaderBlock, 1);
+}
+
+/*
+ * Write the first n blocks of the buffer at the current position.
+ */
+static FRESULT rawlog_commit(uint32_t n) {
+	if (rawlog.next + n > rawlog.sectors - 1) {
+		return FR_DENIED;
+	}
+	if (rawlog_transfer(TRUE, rawlog.start + 1 + rawlog.next,
+			(uint8_t *)rawlogBuffer, n) != FR_OK) {
+		return FR_DISK_ERR;
+	}
+	rawlog.next += n;
+	return FR_OK;
+}
+
+/*
+ * Create the region file of size bytes (rounded up to whole blocks, plus one
+ * header sector). Call it on a freshly formatted volume so that the clusters
+ * are allocated in a single run.
+ */
+FRESULT rawlogReserve(uint32_t size) {
+	FIL *fil;
+	FRESULT err;
+	UINT written;
+	uint32_t start, sectors;
+
+	if (!chMtxTryLock(&rawlogMtx)) {
+		return FR_LOCKED;
+	}
+	if (rawlog.open) {
+		chMtxUnlock();
+		return FR_LOCKED;
+	}
+	size = ((size + MMCSD_BLOCK_SIZE - 1) / MMCSD_BLOCK_SIZE + 1) * MMCSD_BLOCK_SIZE;
+	fil = fsFileAlloc();
+	if (fil == NULL) {
+		chMtxUnlock();
+		return FR_NOT_ENOUGH_CORE;
+	}
+	err = f_open(fil, RAWLOG_FILENAME, FA_WRITE | FA_CREATE_ALWAYS);
+	if (err != FR_OK) {
+		fsFileFree(fil);
+		chMtxUnlock();
+		return err;
+	}
+	/*
+	 * Seeking past the end of a file opened for writing allocates the
+	 * clusters, on an empty volume they are handed out back to back.
+	 */
+	err = f_lseek(fil, size);
+	if (err == FR_OK && f_tell(fil) != size) {
+		err = FR_DENIED;
+	}
+	/*
+	 * Write an empty header so a stale one is never picked up.
+	 */
+	if (err == FR_OK) {
+		memset(&rawlog.header, 0, sizeof(rawlog.header));
+		rawlog.header.magic = RAWLOG_MAGIC;
+		rawlog.header.version = 1;
+		memset(rawlogHeaderBlock, 0, sizeof(rawlogHeaderBlock));
+		memcpy(rawlogHeaderBlock, &rawlog.header, sizeof(rawlog.header));
+		err = f_lseek(fil, 0);
+		if (err == FR_OK) {
+			err = f_write(fil, rawlogHeaderBlock, MMCSD_BLOCK_SIZE, &written);
+		}
+	}
+	f_close(fil);
+	fsFileFree(fil);
+	if (err == FR_OK) {
+		err = rawlog_locate(&start, &sectors);
+	}
+	if (err != FR_OK) {
+		f_unlink(RAWLOG_FILENAME);
+	}
+	chMtxUnlock();
+	return err;
+}
+
+/*
+ * The buffers are SDIO DMA sources, checked at boot rather than on the
+ * first capture.
+ */
+void rawlogInit(void) {
+	memAssertDma(rawlogBuffer);
+	memAssertDma(rawlogHeaderBlock);
+}
+
+/*
+ * Open the region for writing, the log restarts at the first data block.
+ */
+FRESULT rawlogOpen(void) {
+	FRESULT err;
+
+	if (rawlog.open) {
+		return FR_OK;
+	}
+	err = fatWaitReady(MS2ST(FAT_READY_TIMEOUT_MS));
+	if (err != FR_OK) {
+		return err;
+	}
+	err = rawlog_locate(&rawlog.start, &rawlog.sectors);
+	if (err != FR_OK) {
+		return err;
+	}
+	if (rawlog_transfer(FALSE, rawlog.start, (uint8_t *)rawlogHeaderBlock, 1) != FR_OK) {
+		return FR_DISK_ERR;
+	}
+	memcpy(&rawlog.header, rawlogHeaderBlock, sizeof(rawlog.header));
+	if (rawlog.header.magic != RAWLOG_MAGIC) {
+		memset(&rawlog.header, 0, sizeof(rawlog.header));
+		rawlog.header.magic = RAWLOG_MAGIC;
+		rawlog.header.version = 1;
+	}
+	rawlog.header.sessions++;
+	rawlog.header.blocks = 0;
+	rawlog.header.bytes = 0;
+	rawlog.next = 0;
+	rawlog.fill = 0;
+	err = rawlog_write_header();
+	if (err != FR_OK) {
+		return err;
+	}
+	rawlog.open = TRUE;
+	return FR_OK;
+}
+
+/*
+ * Append n bytes to the log, a multi-block write is issued every time the
+ * buffer fills up.
+ */
+FRESULT rawlogWrite(const void *data, uint32_t n) {
+	const uint8_t *p = data;
+	uint32_t chunk;
+	FRESULT err;
+
+	if (!rawlog.open) {
+		return FR_NOT_ENABLED;
+	}
+	while (n > 0) {
+		chunk = sizeof(rawlogBuffer) - rawlog.fill;
+		if (chunk > n) {
+			chunk = n;
+		}
+		memcpy((uint8_t *)rawlogBuffer + rawlog.fill, p, chunk);
+		rawlog.fill += chunk;
+		rawlog.header.bytes += chunk;
+		p += chunk;
+		n -= chunk;
+		if (rawlog.fill == sizeof(rawlogBuffer)) {
+			err = rawlog_commit(RAWLOG_BUFFER_BLOCKS);
+			if (err != FR_OK) {
+				rawlog.header.bytes -= rawlog.fill;
+				rawlog.fill = 0;
+				return err;
+			}
+			rawlog.fill = 0;
+		}
+	}
+	return FR_OK;
+}
+
+/*
+ * Push the buffered data and the header to the card. A trailing partial
+ * block is written padded but stays in the buffer, the next appends
+ * complete it in place so the stream has no holes.
+ */
+FRESULT rawlogFlush(void) {
+	uint32_t full, part;
+	FRESULT err;
+
+	if (!rawlog.open) {
+		return FR_NOT_ENABLED;
+	}
+	full = rawlog.fill / MMCSD_BLOCK_SIZE;
+	part = rawlog.fill % MMCSD_BLOCK_SIZE;
+	if (full > 0) {
+		err = rawlog_commit(full);
+		if (err != FR_OK) {
+			return err;
+		}
+		memmove(rawlogBuffer, (uint8_t *)rawlogBuffer + full * MMCSD_BLOCK_SIZE, part);
+		rawlog.fill = part;
+	}
+	if (part > 0) {
+		if (rawlog.next + 1 > rawlog.sectors - 1) {
+			return FR_DENIED;
+		}
+		memset((uint8_t *)rawlogBuffer + part, 0, MMCSD_BLOCK_SIZE - part);
+		if (rawlog_transfer(TRUE, rawlog.start + 1 + rawlog.next,
+				(uint8_t *)rawlogBuffer, 1) != FR_OK) {
+			return FR_DISK_ERR;
+		}
+	}
+	rawlog.header.blocks = rawlog.next + (part > 0 ? 1 : 0);
+	return rawlog_write_header();
+}
+
+FRESULT rawlogClose(void) {
+	FRESULT err;
+
+	if (!rawlog.open) {
+		return FR_OK;
+	}
+	err = rawlogFlush();
+	rawlog.open = FALSE;
+	return err;
+}
+
+/*
+ * Erase the data blocks so that the following stream lands on erased
+ * memory, the log must be open.
+ */
+FRESULT rawlogErase(void) {
+	if (!rawlog.open) {
+		return FR_NOT_ENABLED;
+	}
+	if (diskErase(rawlog.start + 1, rawlog.start + rawlog.sectors - 1)) {
+		return FR_DISK_ERR;
+	}
+	return FR_OK;
+}
+
+bool_t rawlogIsOpen(void) {
+	return rawlog.open;
+}
+
+/*
+ * Stream kib KiB of pattern data and report the throughput.
+ */
+static void rawlog_bench(BaseSequentialStream *chp, uint32_t kib) {
+	static uint32_t pattern[MMCSD_BLOCK_SIZE / sizeof(uint32_t)];
+	systime_t start, elapsed;
+	uint32_t i, n;
+	FRESULT err = FR_OK;
+
+	for (i = 0; i < sizeof(pattern) / sizeof(pattern[0]); i++) {
+		pattern[i] = i;
+	}
+	n = kib * 1024 / sizeof(pattern);
+	start = chTimeNow();
+	for (i = 0; i < n && err == FR_OK && !jobCancelled(); i++) {
+		pattern[0] = i;
+		err = rawlogWrite(pattern, sizeof(pattern));
+	}
+	if (err == FR_OK) {
+		err = rawlogFlush();
+	}
+	elapsed = chTimeNow() - start;
+	if (err == FR_OK && i < n) {
+		chprintf(chp, "RAWLOG: cancelled after %lu blocks\r\n", i);
+		return;
+	}
+	if (err != FR_OK) {
+		chprintf(chp, "RAWLOG: write failed after %lu blocks\r\n", i);
+		verbose_error(chp, err);
+		return;
+	}
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	chprintf(chp, "RAWLOG: %lu KiB in %lu ms, %lu KiB/s\r\n",
+		kib, (uint32_t)elapsed, (kib * 1000) / (uint32_t)elapsed);
+}
+
+static void rawlog_cmd(BaseSequentialStream *chp, int argc, char *argv[]) {
+	FRESULT err = FR_OK;
+
+	if (argc < 1) {
+		chprintf(chp, "Usage: rawlog open|close|erase|status|bench [KiB]\r\n");
+		chprintf(chp, "       Streams blocks to %s, see mkfs\r\n", RAWLOG_FILENAME);
+		return;
+	}
+	if (strcmp(argv[0], "open") == 0) {
+		err = rawlogOpen();
+	} else if (strcmp(argv[0], "close") == 0) {
+		err = rawlogClose();
+	} else if (strcmp(argv[0], "erase") == 0) {
+		err = rawlogOpen();
+		if (err == FR_OK) {
+			err = rawlogErase();
+		}
+	} else if (strcmp(argv[0], "bench") == 0) {
+		err = rawlogOpen();
+		if (err == FR_OK) {
+			rawlog_bench(chp, argc > 1 ? (uint32_t)atoi(argv[1]) : 1024);
+		}
+	} else if (strcmp(argv[0], "status") != 0) {
+		chprintf(chp, "Usage: rawlog open|close|erase|status|bench [KiB]\r\n");
+		return;
+	}
+	if (err != FR_OK) {
+		chprintf(chp, "RAWLOG: %s failed\r\n", argv[0]);
+		verbose_error(chp, err);
+		return;
+	}
+	if (!rawlog.open) {
+		chprintf(chp, "RAWLOG: closed\r\n");
+		return;
+	}
+	chprintf(chp, "RAWLOG: open, sectors %lu-%lu, session %lu\r\n",
+		rawlog.start, rawlog.start + rawlog.sectors - 1, rawlog.header.sessions);
+	chprintf(chp, "        %lu of %lu blocks used, %lu B logged\r\n",
+		rawlog.next, rawlog.sectors - 1, rawlog.header.bytes);
+}
+
+void cmd_rawlog(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if (!chMtxTryLock(&rawlogMtx)) {
+		chprintf(chp, "RAWLOG: busy, see jobs\r\n");
+		return;
+	}
+	rawlog_cmd(chp, argc, argv);
+	chMtxUnlock();
+}
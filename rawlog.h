@@ -0,0 +1,54 @@
+/*
+ * rawlog.h
+ *
+ *  Raw sector logging into a reserved, contiguous and FAT visible region.
+ */
+
+#ifndef RAWLOG_H_
+#define RAWLOG_H_
+
+#include "ff.h"
+
+/**
+ * @brief   Name of the FAT file spanning the reserved region.
+ */
+#if !defined(RAWLOG_FILENAME)
+#define RAWLOG_FILENAME         "RAWLOG.BIN"
+#endif
+
+/**
+ * @brief   Number of 512 bytes blocks collected before a multi-block write.
+ */
+#if !defined(RAWLOG_BUFFER_BLOCKS)
+#define RAWLOG_BUFFER_BLOCKS    32
+#endif
+
+/**
+ * @brief   Magic value stored in the first sector of the region.
+ */
+#define RAWLOG_MAGIC            0x474F4C52UL    /* "RLOG" */
+
+/**
+ * @brief   Header stored in the first sector of the region.
+ * @details The data blocks follow the header sector. A host reading
+ *          RAWLOG.BIN uses @p blocks to know how much of the file is valid.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t blocks;          /* Valid data blocks after the header.          */
+  uint32_t bytes;           /* Valid data bytes after the header.           */
+  uint32_t sessions;        /* Number of times the log has been opened.     */
+} RawLogHeader;
+
+void rawlogInit(void);
+FRESULT rawlogReserve(uint32_t size);
+FRESULT rawlogOpen(void);
+FRESULT rawlogWrite(const void *data, uint32_t n);
+FRESULT rawlogFlush(void);
+FRESULT rawlogClose(void);
+FRESULT rawlogErase(void);
+bool_t rawlogIsOpen(void);
+void cmd_rawlog(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* RAWLOG_H_ */
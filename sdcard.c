@@ -0,0 +1,500 @@
+/*
+ * sdcard.c
+ *
+ *  SD card registers beyond what the SDC driver reads at connect time.
+ *
+ *  The SDC driver only moves 512 bytes blocks, the short register reads
+ *  done here (SD Status) program the SDIO data path directly and drain the
+ *  FIFO by polling, the whole transfer fits in the 32 words FIFO.
+ */
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+#include "ff.h"
+
+#include "disk.h"
+#include "fspool.h"
+#include "shell.h"
+#include "jobs.h"
+#include "memmap.h"
+#include "sdcard.h"
+
+/*
+ * SDIO data path flags.
+ */
+#define SDIO_STA_DATA_ERRORS    (SDIO_STA_DCRCFAIL | SDIO_STA_DTIMEOUT |    \
+                                 SDIO_STA_RXOVERR | SDIO_STA_STBITERR)
+#define SDIO_ICR_ALL_FLAGS      0x00C007FF
+
+/*
+ * Data timeout in SDIO clock cycles, about 100ms at the data clock.
+ */
+#define SDCARD_DATA_TIMEOUT     2400000
+
+/*
+ * Allocation unit sizes in sectors for the AU_SIZE codes 0xA to 0xF.
+ */
+static const uint32_t sdcardLargeAu[] = {16384, 24576, 32768, 49152, 65536, 131072};
+
+/*
+ * Minimum sequential write speed in MB/s for the SPEED_CLASS codes.
+ */
+static const uint8_t sdcardSpeedClass[] = {0, 2, 4, 6, 10};
+
+/*
+ * Manufacturer IDs commonly found in the CID, unofficial.
+ */
+static const struct {
+	uint8_t mid;
+	const char *name;
+} sdcardManufacturers[] = {
+	{0x01, "Panasonic"},
+	{0x02, "Toshiba"},
+	{0x03, "SanDisk"},
+	{0x1B, "Samsung"},
+	{0x1D, "ADATA"},
+	{0x27, "Phison"},
+	{0x28, "Lexar"},
+	{0x31, "Silicon Power"},
+	{0x41, "Kingston"},
+	{0x74, "Transcend"},
+	{0x76, "Patriot"},
+	{0x82, "Sony"},
+	{0x9C, "Angelbird"}
+};
+
+static SDCardInfo sdcardInfo;
+
+/*
+ * Extract bits msb..lsb of a big endian register of nbits bits stored as
+ * it comes off the bus.
+ */
+uint32_t sdcardGetBits(const uint8_t *data, uint32_t nbits, uint32_t msb, uint32_t lsb) {
+	uint32_t value = 0;
+	uint32_t bit;
+
+	for (bit = msb + 1; bit-- > lsb;) {
+		value = (value << 1) |
+			((data[(nbits - 1 - bit) / 8] >> (bit % 8)) & 1);
+	}
+	return value;
+}
+
+/*
+ * Extract bits msb..lsb of a 128 bits register as stored by the SDC driver,
+ * least significant word first.
+ */
+uint32_t sdcardGetSlice(const uint32_t *data, uint32_t msb, uint32_t lsb) {
+	uint32_t value = 0;
+	uint32_t bit;
+
+	for (bit = msb + 1; bit-- > lsb;) {
+		value = (value << 1) | ((data[bit / 32] >> (bit % 32)) & 1);
+	}
+	return value;
+}
+
+/*
+ * Read a short data block (n bytes, power of two up to 64) returned by the
+ * command cmd, an application specific command if acmd is set.
+ */
+static bool_t sdcard_read_register(SDCDriver *sdcp, bool_t acmd, uint8_t cmd,
+		uint32_t arg, uint8_t *buf, uint32_t n) {
+	uint32_t resp[1];
+	uint32_t words[16];
+	uint32_t i = 0, bs = 0, sta;
+
+	if (acmd && (sdc_lld_send_cmd_short_crc(sdcp, MMCSD_CMD_APP_CMD,
+			sdcp->rca, resp) || MMCSD_R1_ERROR(resp[0]))) {
+		return CH_FAILED;
+	}
+	while ((1U << bs) < n) {
+		bs++;
+	}
+	/*
+	 * Data path armed before the command, as the card may start sending
+	 * right after the response.
+	 */
+	SDIO->ICR = SDIO_ICR_ALL_FLAGS;
+	SDIO->MASK = 0;
+	SDIO->DTIMER = SDCARD_DATA_TIMEOUT;
+	SDIO->DLEN = n;
+	SDIO->DCTRL = (bs << 4) | SDIO_DCTRL_DTDIR | SDIO_DCTRL_DTEN;
+	if (sdc_lld_send_cmd_short_crc(sdcp, cmd, arg, resp) ||
+			MMCSD_R1_ERROR(resp[0])) {
+		SDIO->DCTRL = 0;
+		SDIO->ICR = SDIO_ICR_ALL_FLAGS;
+		return CH_FAILED;
+	}
+	while (TRUE) {
+		sta = SDIO->STA;
+		if (sta & SDIO_STA_RXDAVL) {
+			if (i < n / 4) {
+				words[i++] = SDIO->FIFO;
+			} else {
+				(void)SDIO->FIFO;
+			}
+			continue;
+		}
+		if (sta & (SDIO_STA_DATAEND | SDIO_STA_DATA_ERRORS)) {
+			break;
+		}
+	}
+	SDIO->DCTRL = 0;
+	SDIO->ICR = SDIO_ICR_ALL_FLAGS;
+	if ((sta & SDIO_STA_DATA_ERRORS) || i != n / 4) {
+		return CH_FAILED;
+	}
+	memcpy(buf, words, n);
+	return CH_SUCCESS;
+}
+
+/*
+ * Bus clock settings from the fastest down, SDIOCLK is 48MHz and the bus
+ * clock is SDIOCLK / (CLKDIV + 2) unless bypassed. The first one requires
+ * the card to be in High Speed mode.
+ */
+static const struct {
+	uint32_t clkcr;
+	uint32_t hz;
+} sdcardClocks[] = {
+	{SDIO_CLKCR_BYPASS, 48000000},
+	{0, 24000000},
+	{1, 16000000},
+	{2, 12000000},
+	{4, 8000000}
+};
+#define SDCARD_CLOCKS   (sizeof(sdcardClocks) / sizeof(sdcardClocks[0]))
+
+static uint32_t sdcardClock;
+
+/* Benchmark buffer, word aligned for the SDIO DMA.*/
+static uint32_t sdcardScratch[8 * MMCSD_BLOCK_SIZE / sizeof(uint32_t)];
+
+static void sdcard_set_clock(uint32_t i) {
+	sdcardClock = i;
+	SDIO->CLKCR = (SDIO->CLKCR & ~(SDIO_CLKCR_CLKDIV | SDIO_CLKCR_BYPASS)) |
+		sdcardClocks[i].clkcr;
+	sdcardInfo.clock = sdcardClocks[i].hz;
+}
+
+/*
+ * Switch to 1 bit mode if the card does not list 4 bit support in its SCR,
+ * the SDC driver always selects 4 bit. The disk lock must be held.
+ */
+static void sdcard_set_bus_width(SDCDriver *sdcp) {
+	uint32_t resp[1];
+
+	if (!(sdcardGetBits(sdcardInfo.scr, 64, 51, 48) & 4) &&
+			!sdc_lld_send_cmd_short_crc(sdcp, MMCSD_CMD_APP_CMD, sdcp->rca, resp) &&
+			!sdc_lld_send_cmd_short_crc(sdcp, SDCARD_ACMD_SET_BUS_WIDTH, 0, resp)) {
+		sdc_lld_set_bus_mode(sdcp, SDC_MODE_1BIT);
+	}
+	sdcardInfo.buswidth = (SDIO->CLKCR & SDIO_CLKCR_WIDBUS) ? 4 : 1;
+}
+
+/*
+ * Query the CMD6 function table and switch to High Speed when supported
+ * (access mode group, function 1). The disk lock must be held.
+ */
+static void sdcard_set_high_speed(SDCDriver *sdcp) {
+	/* SD_SPEC 1.10 and later only.*/
+	if (sdcardGetBits(sdcardInfo.scr, 64, 59, 56) < 1) {
+		return;
+	}
+	if (sdcard_read_register(sdcp, FALSE, SDCARD_CMD_SWITCH_FUNC, 0x00FFFFF1,
+			sdcardInfo.sw, sizeof(sdcardInfo.sw))) {
+		return;
+	}
+	sdcardInfo.hscapable = (sdcardGetBits(sdcardInfo.sw, 512, 415, 400) & 2) != 0;
+	if (!sdcardInfo.hscapable) {
+		return;
+	}
+	if (sdcard_read_register(sdcp, FALSE, SDCARD_CMD_SWITCH_FUNC, 0x80FFFFF1,
+			sdcardInfo.sw, sizeof(sdcardInfo.sw))) {
+		return;
+	}
+	sdcardInfo.highspeed = sdcardGetBits(sdcardInfo.sw, 512, 379, 376) == 1;
+}
+
+/*
+ * Decode the identification, capacity, version and performance fields of
+ * the raw registers.
+ */
+static void sdcard_decode(SDCDriver *sdcp) {
+	uint32_t i, code, size;
+
+	/* CID.*/
+	sdcardInfo.mid = sdcardGetSlice(sdcp->cid, 127, 120);
+	for (i = 0; i < 2; i++) {
+		sdcardInfo.oid[i] = sdcardGetSlice(sdcp->cid, 119 - 8 * i, 112 - 8 * i);
+	}
+	for (i = 0; i < 5; i++) {
+		sdcardInfo.pnm[i] = sdcardGetSlice(sdcp->cid, 103 - 8 * i, 96 - 8 * i);
+	}
+	sdcardInfo.prv = sdcardGetSlice(sdcp->cid, 63, 56);
+	sdcardInfo.psn = sdcardGetSlice(sdcp->cid, 55, 24);
+	sdcardInfo.year = 2000 + sdcardGetSlice(sdcp->cid, 19, 12);
+	sdcardInfo.month = sdcardGetSlice(sdcp->cid, 11, 8);
+	/* CSD.*/
+	sdcardInfo.csdversion = sdcardGetSlice(sdcp->csd, 127, 126) + 1;
+	sdcardInfo.capacity = mmcsdGetCardCapacity(sdcp);
+	/* SCR, SD_SPEC with the SD_SPEC3 and SD_SPEC4 extensions.*/
+	code = sdcardGetBits(sdcardInfo.scr, 64, 59, 56);
+	sdcardInfo.spec = code == 0 ? 100 : (code == 1 ? 110 : 200);
+	if (code == 2 && sdcardGetBits(sdcardInfo.scr, 64, 47, 47)) {
+		sdcardInfo.spec = sdcardGetBits(sdcardInfo.scr, 64, 42, 42) ? 400 : 300;
+	}
+	sdcardInfo.cmd23 = (sdcardGetBits(sdcardInfo.scr, 64, 35, 32) & 2) != 0;
+	/* SD Status.*/
+	code = sdcardGetBits(sdcardInfo.ssr, 512, 447, 440);
+	sdcardInfo.speedclass = code < sizeof(sdcardSpeedClass) ? sdcardSpeedClass[code] : 0;
+	sdcardInfo.uhsgrade = sdcardGetBits(sdcardInfo.ssr, 512, 399, 396);
+	sdcardInfo.videoclass = sdcardGetBits(sdcardInfo.ssr, 512, 391, 384);
+	/*
+	 * ERASE_TIMEOUT seconds cover ERASE_SIZE AUs, ERASE_OFFSET is added
+	 * once per erase.
+	 */
+	size = sdcardGetBits(sdcardInfo.ssr, 512, 423, 408);
+	if (size > 0) {
+		sdcardInfo.erasetimeout =
+			sdcardGetBits(sdcardInfo.ssr, 512, 407, 402) * 1000 / size +
+			sdcardGetBits(sdcardInfo.ssr, 512, 401, 400) * 1000;
+	}
+}
+
+/*
+ * Derive the sizing advice from the card geometry and write latency.
+ */
+static void sdcard_recommend(void) {
+	uint32_t au, rate, stall;
+
+	/* One cluster per AU when it fits FAT limits, f_mkfs() default else.*/
+	au = sdcardInfo.ausize * MMCSD_BLOCK_SIZE;
+	sdcardInfo.cluster = au > 32768 ? 32768 : (au < 4096 ? 0 : au);
+	/* Logs grow a whole AU at a time so that no AU is shared by two files.*/
+	au = sdcardBlockSize() * MMCSD_BLOCK_SIZE;
+	sdcardInfo.prealloc = au < 65536 ? 65536 : au;
+	/*
+	 * Data arriving at the rated speed during the worst write busy, class
+	 * 2 assumed for unrated cards and the SDHC limit until measured.
+	 * 1MB/s is one byte per microsecond.
+	 */
+	rate = sdcardInfo.speedclass > 2 ? sdcardInfo.speedclass : 2;
+	stall = sdcardInfo.wlatmax > 0 ? sdcardInfo.wlatmax : SDCARD_WRITE_TIMEOUT_US;
+	sdcardInfo.bufbytes = (rate * stall + MMCSD_BLOCK_SIZE - 1) &
+		~(MMCSD_BLOCK_SIZE - 1);
+}
+
+/*
+ * Read the card properties and negotiate the fastest bus mode that
+ * transfers without errors, the card must be connected.
+ */
+bool_t sdcardProbe(SDCDriver *sdcp) {
+	uint32_t au, sectors;
+	bool_t err;
+
+	memAssertDma(sdcardScratch);
+	memset(&sdcardInfo, 0, sizeof(sdcardInfo));
+	/*
+	 * Erase sector from the CSD, SECTOR_SIZE is in write blocks.
+	 */
+	sectors = (sdcardGetSlice(sdcp->csd, 45, 39) + 1) <<
+		sdcardGetSlice(sdcp->csd, 25, 22);
+	sdcardInfo.eraseblk = sectors / MMCSD_BLOCK_SIZE;
+	diskLock();
+	/*
+	 * Allocation unit from the SD Status.
+	 */
+	err = sdcard_read_register(sdcp, TRUE, SDCARD_ACMD_SD_STATUS, 0,
+		sdcardInfo.ssr, sizeof(sdcardInfo.ssr));
+	if (!err) {
+		au = sdcardGetBits(sdcardInfo.ssr, 512, 431, 428);
+		if (au >= 0xA) {
+			sdcardInfo.ausize = sdcardLargeAu[au - 0xA];
+		} else if (au > 0) {
+			sdcardInfo.ausize = 32U << (au - 1);
+		}
+	}
+	/*
+	 * Bus width and speed from the SCR and the switch function table.
+	 */
+	if (!sdcard_read_register(sdcp, TRUE, SDCARD_ACMD_SEND_SCR, 0,
+			sdcardInfo.scr, sizeof(sdcardInfo.scr))) {
+		sdcard_set_bus_width(sdcp);
+		sdcard_set_high_speed(sdcp);
+	} else {
+		err = CH_FAILED;
+		sdcardInfo.buswidth = (SDIO->CLKCR & SDIO_CLKCR_WIDBUS) ? 4 : 1;
+	}
+	sdcard_set_clock(sdcardInfo.highspeed ? 0 : 1);
+	diskUnlock();
+	/*
+	 * Step the clock down until reads are clean.
+	 */
+	while (sdcardBenchmark() == 0) {
+		if (sdcardClockDown()) {
+			err = CH_FAILED;
+			break;
+		}
+	}
+	sdcard_decode(sdcp);
+	sdcard_recommend();
+	sdcardInfo.valid = TRUE;
+	return err;
+}
+
+/*
+ * Lower the bus clock by one step after transfer errors, fails when
+ * already at the slowest setting.
+ */
+bool_t sdcardClockDown(void) {
+	if (sdcardClock + 1 >= SDCARD_CLOCKS) {
+		return CH_FAILED;
+	}
+	diskLock();
+	sdcard_set_clock(sdcardClock + 1);
+	sdcardInfo.fallbacks++;
+	diskUnlock();
+	sdcGetAndClearErrors(&SDCD1);
+	return CH_SUCCESS;
+}
+
+/*
+ * Reset the card after transfer errors and restore the negotiated bus
+ * mode, one clock step lower if slower is set. The disk lock must be held,
+ * the file system state is untouched.
+ */
+bool_t sdcardRecover(SDCDriver *sdcp, bool_t slower) {
+	sdcDisconnect(sdcp);
+	if (sdcConnect(sdcp)) {
+		return CH_FAILED;
+	}
+	sdcGetAndClearErrors(sdcp);
+	sdcard_set_bus_width(sdcp);
+	if (sdcardInfo.highspeed) {
+		sdcardInfo.highspeed = FALSE;
+		sdcard_set_high_speed(sdcp);
+	}
+	if (slower && sdcardClock + 1 < SDCARD_CLOCKS) {
+		sdcardClock++;
+		sdcardInfo.fallbacks++;
+	}
+	/* The High Speed only setting is not valid if the switch failed.*/
+	sdcard_set_clock(sdcardClock == 0 && !sdcardInfo.highspeed ? 1 : sdcardClock);
+	return CH_SUCCESS;
+}
+
+/*
+ * Time multi-block reads from the start of the card, returns the throughput
+ * in KiB/s or zero if a read failed.
+ */
+uint32_t sdcardBenchmark(void) {
+	halrtcnt_t start;
+	uint32_t i, us, n = sizeof(sdcardScratch) / MMCSD_BLOCK_SIZE;
+
+	start = halGetCounterValue();
+	for (i = 0; i < SDCARD_BENCH_SECTORS; i += n) {
+		if (diskRead(i, (uint8_t *)sdcardScratch, n)) {
+			sdcardInfo.throughput = 0;
+			return 0;
+		}
+	}
+	us = (halGetCounterValue() - start) / (halGetCounterFrequency() / 1000000) + 1;
+	sdcardInfo.throughput = (uint32_t)((uint64_t)(SDCARD_BENCH_SECTORS / 2) * 1000000 / us);
+	return sdcardInfo.throughput;
+}
+
+/*
+ * Time 4KiB writes to a scratch file, the latency spread shows how long the
+ * card stays busy on internal garbage collection. The file system must be
+ * mounted.
+ */
+bool_t sdcardLatencyProbe(void) {
+	FIL *fil;
+	FRESULT err;
+	UINT n;
+	halrtcnt_t start;
+	uint32_t i, us, total = 0, min = 0xFFFFFFFF, max = 0;
+
+	fil = fsFileAlloc();
+	if (fil == NULL) {
+		return CH_FAILED;
+	}
+	err = f_open(fil, SDCARD_PROBE_FILENAME, FA_WRITE | FA_CREATE_ALWAYS);
+	if (err != FR_OK) {
+		fsFileFree(fil);
+		return CH_FAILED;
+	}
+	memset(sdcardScratch, 0xA5, sizeof(sdcardScratch));
+	for (i = 0; i < SDCARD_PROBE_WRITES && err == FR_OK && !jobCancelled(); i++) {
+		start = halGetCounterValue();
+		err = f_write(fil, sdcardScratch, sizeof(sdcardScratch), &n);
+		us = (halGetCounterValue() - start) / (halGetCounterFrequency() / 1000000);
+		if (err == FR_OK && n != sizeof(sdcardScratch)) {
+			err = FR_DENIED;
+		}
+		total += us;
+		min = us < min ? us : min;
+		max = us > max ? us : max;
+	}
+	f_close(fil);
+	fsFileFree(fil);
+	f_unlink(SDCARD_PROBE_FILENAME);
+	if (err != FR_OK || i < SDCARD_PROBE_WRITES) {
+		return CH_FAILED;
+	}
+	sdcardInfo.wlatmin = min;
+	sdcardInfo.wlatavg = total / SDCARD_PROBE_WRITES;
+	sdcardInfo.wlatmax = max;
+	sdcard_recommend();
+	return CH_SUCCESS;
+}
+
+const char *sdcardManufacturer(uint8_t mid) {
+	uint32_t i;
+
+	for (i = 0; i < sizeof(sdcardManufacturers) / sizeof(sdcardManufacturers[0]); i++) {
+		if (sdcardManufacturers[i].mid == mid) {
+			return sdcardManufacturers[i].name;
+		}
+	}
+	return "unknown";
+}
+
+const SDCardInfo *sdcardGetInfo(void) {
+	return &sdcardInfo;
+}
+
+/*
+ * Best alignment for the file system data area, in sectors.
+ */
+uint32_t sdcardBlockSize(void) {
+	if (sdcardInfo.ausize > 0) {
+		return sdcardInfo.ausize;
+	}
+	if (sdcardInfo.eraseblk > 0) {
+		return sdcardInfo.eraseblk;
+	}
+	return 1;
+}
+
+/*
+ * Tell the card how many blocks the next multi-block write carries so it
+ * can pre-erase them (ACMD23), the disk lock must be held.
+ */
+bool_t sdcardSetEraseCount(SDCDriver *sdcp, uint32_t n) {
+	uint32_t resp[1];
+
+	if (sdc_lld_send_cmd_short_crc(sdcp, MMCSD_CMD_APP_CMD, sdcp->rca, resp) ||
+			MMCSD_R1_ERROR(resp[0])) {
+		return CH_FAILED;
+	}
+	if (sdc_lld_send_cmd_short_crc(sdcp, SDCARD_ACMD_SET_WR_BLK_ERASE_COUNT,
+			n & 0x007FFFFF, resp) || MMCSD_R1_ERROR(resp[0])) {
+		return CH_FAILED;
+	}
+	return CH_SUCCESS;
+}
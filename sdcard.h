@@ -0,0 +1,105 @@
+/*
+ * sdcard.h
+ *
+ *  SD card registers beyond what the SDC driver reads at connect time.
+ */
+
+#ifndef SDCARD_H_
+#define SDCARD_H_
+
+/*
+ * SD specific commands not defined by the MMC/SD driver.
+ */
+#define SDCARD_CMD_SWITCH_FUNC      6
+#define SDCARD_ACMD_SET_BUS_WIDTH   6
+#define SDCARD_ACMD_SD_STATUS       13
+#define SDCARD_ACMD_SET_WR_BLK_ERASE_COUNT 23
+#define SDCARD_ACMD_SEND_SCR        51
+
+/**
+ * @brief   Sectors read to measure the throughput of a bus setting.
+ */
+#if !defined(SDCARD_BENCH_SECTORS)
+#define SDCARD_BENCH_SECTORS        512
+#endif
+
+/**
+ * @brief   Write busy time assumed until measured, the SDHC limit.
+ */
+#if !defined(SDCARD_WRITE_TIMEOUT_US)
+#define SDCARD_WRITE_TIMEOUT_US     250000
+#endif
+
+/**
+ * @brief   Scratch file of the latency probe, removed afterwards.
+ */
+#define SDCARD_PROBE_FILENAME       "SDPROBE.TMP"
+
+/**
+ * @brief   Writes issued by the latency probe, of 4KiB each.
+ */
+#if !defined(SDCARD_PROBE_WRITES)
+#define SDCARD_PROBE_WRITES         64
+#endif
+
+/**
+ * @brief   Card properties, negotiated bus mode and sizing advice.
+ * @details Filled by sdcardProbe() at mount, the latency fields by
+ *          sdcardLatencyProbe(). Modules size their files and buffers from
+ *          the last group of fields.
+ */
+typedef struct {
+  bool_t valid;
+  uint32_t ausize;          /* Allocation unit in sectors, 0 if unknown.    */
+  uint32_t eraseblk;        /* Erase block in sectors, from the CSD.        */
+  uint8_t ssr[64];          /* Raw SD Status, ACMD13.                       */
+  uint8_t scr[8];           /* Raw SD Configuration Register, ACMD51.       */
+  uint8_t sw[64];           /* Raw CMD6 function status.                    */
+  bool_t hscapable;         /* Card supports High Speed.                    */
+  bool_t highspeed;         /* Card switched to High Speed.                 */
+  uint32_t buswidth;        /* Data lines in use.                           */
+  uint32_t clock;           /* Bus clock in Hz.                             */
+  uint32_t fallbacks;       /* Clock steps lost to transfer errors.         */
+  uint32_t throughput;      /* Measured read throughput in KiB/s.           */
+  /* CID.*/
+  uint8_t mid;              /* Manufacturer ID.                             */
+  char oid[3];              /* OEM/application ID.                          */
+  char pnm[6];              /* Product name.                                */
+  uint8_t prv;              /* Product revision, BCD n.m.                   */
+  uint32_t psn;             /* Serial number.                               */
+  uint16_t year;            /* Manufacturing date.                          */
+  uint8_t month;
+  /* CSD.*/
+  uint32_t csdversion;
+  uint32_t capacity;        /* Sectors.                                     */
+  /* SCR.*/
+  uint32_t spec;            /* Physical layer version x100.                 */
+  bool_t cmd23;             /* SET_BLOCK_COUNT supported.                   */
+  /* SD Status.*/
+  uint32_t speedclass;      /* Speed class, MB/s.                           */
+  uint32_t uhsgrade;        /* UHS speed grade, U1 = 1, U3 = 3.             */
+  uint32_t videoclass;      /* Video speed class, V6 = 6 ... V90 = 90.      */
+  uint32_t erasetimeout;    /* Time to erase one AU in ms, 0 if unknown.    */
+  /* Write latency probe, us.*/
+  uint32_t wlatmin;
+  uint32_t wlatavg;
+  uint32_t wlatmax;
+  /* Sizing advice.*/
+  uint32_t cluster;         /* Cluster size for mkfs in bytes, 0 = auto.    */
+  uint32_t prealloc;        /* Log preallocation granularity in bytes.      */
+  uint32_t bufbytes;        /* RAM needed to ride out the worst write busy. */
+} SDCardInfo;
+
+bool_t sdcardProbe(SDCDriver *sdcp);
+bool_t sdcardClockDown(void);
+bool_t sdcardRecover(SDCDriver *sdcp, bool_t slower);
+uint32_t sdcardBenchmark(void);
+bool_t sdcardLatencyProbe(void);
+const char *sdcardManufacturer(uint8_t mid);
+const SDCardInfo *sdcardGetInfo(void);
+uint32_t sdcardBlockSize(void);
+bool_t sdcardSetEraseCount(SDCDriver *sdcp, uint32_t n);
+uint32_t sdcardGetBits(const uint8_t *data, uint32_t nbits, uint32_t msb, uint32_t lsb);
+uint32_t sdcardGetSlice(const uint32_t *data, uint32_t msb, uint32_t lsb);
+
+#endif /* SDCARD_H_ */
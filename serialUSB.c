@@ -14,6 +14,7 @@
 
 #include "usbcfg.h"
 #include "serialUSB.h"
+#include "boot.h"
 
 BaseSequentialStream *serialSequentialStream;
 
@@ -26,14 +27,25 @@ void serialUSBInit(BaseSequentialStream *stream){
   sduStart((SerialUSBDriver*)serialSequentialStream, &serusbcfg);
 }
 
-void serialUSBStart(void){
-  /*
-   * Activates the USB driver and then the USB bus pull-up on D+.
-   * Note, a delay is inserted in order to not have to disconnect the cable
-   * after a reset.
-   */
-  usbDisconnectBus(serusbcfg.usbp);
-  chThdSleepMilliseconds(1000);
+/*
+ * Activates the USB driver and then the USB bus pull-up on D+.
+ * Note, a delay is inserted in order to not have to disconnect the cable
+ * after a reset. It runs in its own thread so that the rest of the boot
+ * does not wait for it, the thread ends once the pull-up is on.
+ */
+static WORKING_AREA(serialUSBStartWA, 256);
+static msg_t serialUSBStartThread(void *arg) {
+  (void)arg;
+  chRegSetThreadName("USB start");
+  chThdSleepMilliseconds(SERIAL_USB_DISCONNECT_MS);
   usbStart(serusbcfg.usbp, &usbcfg);
   usbConnectBus(serusbcfg.usbp);
+  bootMark(BOOT_USB_CONNECT);
+  return (msg_t)NULL;
+}
+
+void serialUSBStart(void){
+  usbDisconnectBus(serusbcfg.usbp);
+  chThdCreateStatic(serialUSBStartWA, sizeof(serialUSBStartWA),
+                    NORMALPRIO, serialUSBStartThread, NULL);
 }
\ No newline at end of file
@@ -11,6 +11,14 @@
 
 #include <stdio.h>
 
+/**
+ * @brief   Time the D+ pull-up stays off at boot, long enough for the host
+ *          to notice that the device running before the reset left.
+ */
+#if !defined(SERIAL_USB_DISCONNECT_MS)
+#define SERIAL_USB_DISCONNECT_MS  300
+#endif
+
 void serialUSBInit(BaseSequentialStream *);
 void serialUSBStart(void);
 
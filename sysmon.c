@@ -0,0 +1,206 @@
+/*
+ * sysmon.c
+ *
+ *  CPU load per thread from the DWT cycle counter.
+ *
+ *  The context switch hook (chconf.h) adds the cycles since the previous
+ *  switch to the thread being switched out, p_cycles. top samples them over
+ *  an interval, the load of a thread is its share of the elapsed cycles.
+ *
+ *  Interrupts are charged to the thread they preempt. While the idle thread
+ *  runs its loop is a few cycles long, a longer pass was interrupted: the
+ *  idle loop hook sums those, the time spent in interrupts while idle. It is
+ *  a lower bound of the interrupt load, exact when the CPU is mostly idle.
+ *
+ *  Working areas are filled with CH_STACK_FILL_VALUE when a thread is
+ *  created (CH_DBG_FILL_THREADS) and the startup code fills the main and
+ *  interrupt stacks the same way. The deepest byte no longer holding the
+ *  pattern is the high water mark of the stack.
+ */
+
+#include <stdlib.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+
+#include "sysmon.h"
+
+/* Linker script symbols, the main thread and the interrupts stacks.*/
+extern stkalign_t __main_thread_stack_base__, __main_thread_stack_end__;
+extern stkalign_t __main_stack_base__, __main_stack_end__;
+
+volatile uint32_t sysmonLastSwitch;
+volatile uint32_t sysmonIdleLast;
+volatile uint32_t sysmonSwitches;
+volatile uint32_t sysmonIrqCycles;
+
+typedef struct {
+	Thread *tp;
+	uint32_t cycles;
+} SysmonSample;
+
+typedef struct {
+	uint32_t now;
+	uint32_t switches;
+	uint32_t irq;
+	uint32_t n;
+	SysmonSample threads[SYSMON_THREADS];
+} SysmonSnapshot;
+
+/*
+ * Starts the cycle counter, it wraps every 25s at 168MHz which bounds the
+ * sampling interval.
+ */
+void sysmonInit(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	sysmonLastSwitch = 0;
+	sysmonIdleLast = 0;
+}
+
+/*
+ * Bytes used of the stack from base to top, it grows down.
+ */
+static size_t sysmon_stack_used(const uint8_t *base, const uint8_t *top) {
+	const uint8_t *p = base;
+
+	while (p < top && *p == CH_STACK_FILL_VALUE) {
+		p++;
+	}
+	return (size_t)(top - p);
+}
+
+/*
+ * The stack of a thread lies between its Thread structure and the top
+ * recorded by the init hook (chconf.h). The main thread is not created
+ * from a working area, its stack is the process stack of the linker script.
+ */
+void sysmonThreadStack(Thread *tp, size_t *size, size_t *used) {
+	uint8_t *base, *top;
+
+	if (tp->p_stklimit == &__main_thread_stack_base__) {
+		base = (uint8_t *)&__main_thread_stack_base__;
+		top = (uint8_t *)&__main_thread_stack_end__;
+	} else {
+		base = (uint8_t *)(tp + 1);
+		top = tp->p_stktop;
+	}
+	*size = (size_t)(top - base);
+	*used = sysmon_stack_used(base, top);
+}
+
+/*
+ * The main stack, used by the interrupt handlers.
+ */
+void sysmonIrqStack(size_t *size, size_t *used) {
+	uint8_t *base = (uint8_t *)&__main_stack_base__;
+	uint8_t *top = (uint8_t *)&__main_stack_end__;
+
+	*size = (size_t)(top - base);
+	*used = sysmon_stack_used(base, top);
+}
+
+/*
+ * Cycles charged to the calling thread so far, including the ones since
+ * its last switch in.
+ */
+uint32_t sysmonSelfCycles(void) {
+	uint32_t cycles;
+
+	chSysLock();
+	cycles = chThdSelf()->p_cycles + (DWT->CYCCNT - sysmonLastSwitch);
+	chSysUnlock();
+	return cycles;
+}
+
+static void sysmon_snapshot(SysmonSnapshot *ssp) {
+	Thread *tp;
+	uint32_t i;
+
+	ssp->n = 0;
+	tp = chRegFirstThread();
+	do {
+		if (ssp->n < SYSMON_THREADS) {
+			ssp->threads[ssp->n].tp = tp;
+			ssp->threads[ssp->n].cycles = tp->p_cycles;
+			ssp->n++;
+		}
+		tp = chRegNextThread(tp);
+	} while (tp != NULL);
+	chSysLock();
+	ssp->now = DWT->CYCCNT;
+	ssp->switches = sysmonSwitches;
+	ssp->irq = sysmonIrqCycles;
+	/* The sampling thread has been running since its last switch.*/
+	for (i = 0; i < ssp->n; i++) {
+		if (ssp->threads[i].tp == chThdSelf()) {
+			ssp->threads[i].cycles += ssp->now - sysmonLastSwitch;
+		}
+	}
+	chSysUnlock();
+}
+
+static uint32_t sysmon_cycles(const SysmonSnapshot *ssp, Thread *tp) {
+	uint32_t i;
+
+	for (i = 0; i < ssp->n; i++) {
+		if (ssp->threads[i].tp == tp) {
+			return ssp->threads[i].cycles;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Per mille of total, printed as a percentage.
+ */
+static void sysmon_print_share(BaseSequentialStream *chp, uint32_t part,
+		uint32_t total) {
+	uint32_t pm = (uint32_t)((uint64_t)part * 1000 / total);
+
+	chprintf(chp, "%3lu.%lu%%", pm / 10, pm % 10);
+}
+
+void cmd_top(BaseSequentialStream *chp, int argc, char *argv[]) {
+	SysmonSnapshot before, after;
+	Thread *tp, *idle = chSysGetIdleThread();
+	uint32_t i, ms, count, total;
+	if (argc > 2) {
+		chprintf(chp, "Usage: top [ms] [count]\r\n");
+		chprintf(chp, "       CPU use per thread over [ms] (default %u), [count] times\r\n",
+			SYSMON_INTERVAL_MS);
+		return;
+	}
+	ms = argc > 0 ? (uint32_t)atoi(argv[0]) : SYSMON_INTERVAL_MS;
+	count = argc > 1 ? (uint32_t)atoi(argv[1]) : 1;
+	if (ms < 10 || ms > 10000) {
+		chprintf(chp, "top: interval from 10 to 10000 ms\r\n");
+		return;
+	}
+	while (count-- > 0) {
+		sysmon_snapshot(&before);
+		chThdSleepMilliseconds(ms);
+		sysmon_snapshot(&after);
+		total = after.now - before.now;
+		chprintf(chp, "%lu ms, %lu MHz, %lu switches/s, idle ",
+			total / (halGetCounterFrequency() / 1000),
+			halGetCounterFrequency() / 1000000,
+			(after.switches - before.switches) * 1000 / ms);
+		sysmon_print_share(chp, sysmon_cycles(&after, idle) - sysmon_cycles(&before, idle), total);
+		chprintf(chp, ", irq >= ");
+		sysmon_print_share(chp, after.irq - before.irq, total);
+		chprintf(chp, "\r\n    addr prio    cpu name\r\n");
+		for (i = 0; i < after.n; i++) {
+			tp = after.threads[i].tp;
+			chprintf(chp, "%.8lx %4lu ", (uint32_t)tp, (uint32_t)tp->p_prio);
+			sysmon_print_share(chp, sysmon_cycles(&after, tp) - sysmon_cycles(&before, tp), total);
+			chprintf(chp, " %s\r\n", tp->p_name != NULL ? tp->p_name : "");
+		}
+		if (after.n == SYSMON_THREADS) {
+			chprintf(chp, "(first %u threads)\r\n", SYSMON_THREADS);
+		}
+	}
+}
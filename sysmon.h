@@ -0,0 +1,37 @@
+/*
+ * sysmon.h
+ *
+ *  CPU load per thread from the DWT cycle counter, stack high water marks.
+ */
+
+#ifndef SYSMON_H_
+#define SYSMON_H_
+
+/**
+ * @brief   Most threads sampled by top.
+ */
+#if !defined(SYSMON_THREADS)
+#define SYSMON_THREADS          16
+#endif
+
+/**
+ * @brief   Default top sampling interval.
+ */
+#if !defined(SYSMON_INTERVAL_MS)
+#define SYSMON_INTERVAL_MS      1000
+#endif
+
+/**
+ * @brief   Stack use, in percent, flagged by threads.
+ */
+#if !defined(SYSMON_STACK_WARN)
+#define SYSMON_STACK_WARN       75
+#endif
+
+void sysmonInit(void);
+void sysmonThreadStack(Thread *tp, size_t *size, size_t *used);
+void sysmonIrqStack(size_t *size, size_t *used);
+uint32_t sysmonSelfCycles(void);
+void cmd_top(BaseSequentialStream *chp, int argc, char *argv[]);
+
+#endif /* SYSMON_H_ */
@@ -0,0 +1,71 @@
+/*
+ * timing.c
+ *
+ *  Cycle timing of code regions, per named site.
+ *
+ *  A site wraps a region with two reads of the DWT cycle counter, see
+ *  TIMING(). The sites are registered as metrics of METRIC_TYPE_TIMING and
+ *  keep the call count, min, max, total and a power of two histogram for
+ *  the p99. The time includes the interrupts and the threads that ran in
+ *  between, the min is the undisturbed cost.
+ */
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+
+#include "timing.h"
+
+#if TIMING_ENABLE
+
+void timingRecord(TimingSite *tsp, uint32_t cycles) {
+	uint32_t i = 32 - __CLZ(cycles);
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	tsp->count++;
+	tsp->sum += cycles;
+	tsp->min = cycles < tsp->min ? cycles : tsp->min;
+	tsp->max = cycles > tsp->max ? cycles : tsp->max;
+	tsp->buckets[i < TIMING_BUCKETS ? i : TIMING_BUCKETS - 1]++;
+	__set_PRIMASK(primask);
+}
+
+void timingReset(void) {
+	const Metric *mp;
+	TimingSite *tsp;
+
+	for (mp = metricFirst(); mp < metricEnd(); mp++) {
+		if (mp->type == METRIC_TYPE_TIMING) {
+			tsp = (TimingSite *)mp->value;
+			chSysLock();
+			memset(tsp, 0, sizeof(*tsp));
+			tsp->min = 0xFFFFFFFF;
+			chSysUnlock();
+		}
+	}
+}
+
+void cmd_timing(BaseSequentialStream *chp, int argc, char *argv[]) {
+	const Metric *mp;
+	if (argc > 1 || (argc == 1 && strcmp(argv[0], "reset") != 0)) {
+		chprintf(chp, "Usage: timing [reset]\r\n");
+		chprintf(chp, "       Cycles spent in the timed code regions, %lu MHz\r\n",
+			(uint32_t)(halGetCounterFrequency() / 1000000));
+		return;
+	}
+	if (argc == 1) {
+		timingReset();
+		return;
+	}
+	for (mp = metricFirst(); mp < metricEnd(); mp++) {
+		if (mp->type == METRIC_TYPE_TIMING) {
+			metricPrint(chp, mp);
+		}
+	}
+}
+
+#endif /* TIMING_ENABLE */
@@ -0,0 +1,69 @@
+/*
+ * timing.h
+ *
+ *  Cycle timing of code regions, per named site.
+ */
+
+#ifndef TIMING_H_
+#define TIMING_H_
+
+#include "metrics.h"
+
+/**
+ * @brief   Compiles the timing sites in, set by USE_TIMING in the Makefile.
+ */
+#if !defined(TIMING_ENABLE)
+#define TIMING_ENABLE           TRUE
+#endif
+
+/**
+ * @brief   Histogram buckets of a site, power of two cycle counts.
+ */
+#define TIMING_BUCKETS          32
+
+/**
+ * @brief   Statistics of a timed region, in cycles.
+ */
+typedef struct {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+  uint32_t buckets[TIMING_BUCKETS];
+} TimingSite;
+
+#if TIMING_ENABLE
+/**
+ * @brief   Defines a timing site at file scope, listed by timing and stats.
+ */
+#define TIMING_SITE(var, name)                                              \
+  static TimingSite var = {0, 0xFFFFFFFF, 0, 0, {0}};                       \
+  _METRIC_DESCRIPTOR(var, name, "cycles", METRIC_TYPE_TIMING)
+
+/**
+ * @brief   Starts and ends a timed region, in the same block.
+ */
+#define TIMING_BEGIN(var)       uint32_t var##_start = DWT->CYCCNT
+#define TIMING_END(var)         timingRecord(&(var), DWT->CYCCNT - var##_start)
+#else
+#define TIMING_SITE(var, name)
+#define TIMING_BEGIN(var)
+#define TIMING_END(var)
+#endif
+
+/**
+ * @brief   Times a statement.
+ */
+#define TIMING(var, statement) do {                                         \
+  TIMING_BEGIN(var);                                                        \
+  statement;                                                                \
+  TIMING_END(var);                                                          \
+} while (0)
+
+#if TIMING_ENABLE
+void timingRecord(TimingSite *tsp, uint32_t cycles);
+void timingReset(void);
+void cmd_timing(BaseSequentialStream *chp, int argc, char *argv[]);
+#endif
+
+#endif /* TIMING_H_ */
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Compare two kernel benchmark runs.
+
+Reads the CSV written by "bench file" or "selftest file", or the text
+output of the ChibiOS test suite (a captured console, or the suite run by
+the host simulator), and prints each result of the baseline next to the
+new run with the change in percent.
+
+    tools/benchdiff.py before.csv after.csv
+    tools/benchdiff.py board.csv simulator.log
+"""
+
+import argparse
+import csv
+import re
+import sys
+
+CASE = re.compile(r"--- Test Case (\S+) \((Benchmark.*)\)")
+VALUE = re.compile(r"(\d+) ([^,]+)")
+
+
+def parse_log(lines):
+    results = {}
+    case = None
+    for line in lines:
+        line = line.strip()
+        m = CASE.match(line)
+        if m:
+            case = m.groups()
+            continue
+        if line.startswith("--- Test Case"):
+            case = None
+        if case is None or not line.startswith("--- ") or line.startswith("--- Result"):
+            continue
+        label, _, values = line[4:].partition(":")
+        for value, unit in VALUE.findall(values):
+            results[(case[0], case[1], label.strip(), unit.strip())] = int(value)
+    return results
+
+
+def load(path):
+    with open(path, newline="") as f:
+        lines = f.read().splitlines()
+    if lines and lines[0].startswith("case,name,"):
+        return {(r["case"], r["name"], r["label"], r["unit"]): int(r["value"])
+                for r in csv.DictReader(lines)}
+    return parse_log(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("new")
+    args = parser.parse_args()
+
+    base, new = load(args.baseline), load(args.new)
+    if not base:
+        sys.exit("%s: no benchmark results" % args.baseline)
+    for key in sorted(set(base) | set(new), key=lambda k: [int(n) for n in k[0].split(".")]):
+        case, name, label, unit = key
+        a, b = base.get(key), new.get(key)
+        if a is None or b is None:
+            change = "only in %s" % (args.new if a is None else args.baseline)
+        elif a == 0:
+            change = ""
+        else:
+            change = "%+.1f%%" % ((b - a) * 100.0 / a)
+        print("%-5s %-32s %-7s %10s %10s %-9s %s" % (
+            case, name[:32], label, "-" if a is None else a,
+            "-" if b is None else b, unit, change))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Scrape the firmware metrics over the shell and print them.
+
+Runs "stats bin" on the board and decodes the binary dump described in
+metrics.c. Prints one line per metric, or JSON for other tools, optionally
+every few seconds.
+
+    tools/metrics.py /dev/ttyACM0
+    tools/metrics.py /dev/ttyACM0 --json --every 5
+"""
+
+import argparse
+import json
+import struct
+import sys
+import time
+
+import serial
+
+BUCKETS = 32
+TIMING_BUCKETS = 32
+TYPES = ("counter", "gauge", "histogram", "timing")
+
+
+class Reader:
+    def __init__(self, ser):
+        self.ser = ser
+
+    def read(self, n):
+        data = self.ser.read(n)
+        if len(data) != n:
+            raise TimeoutError("short read from the board")
+        return data
+
+    def u8(self):
+        return self.read(1)[0]
+
+    def u32(self, n=1):
+        return struct.unpack("<%dI" % n, self.read(4 * n))
+
+    def string(self):
+        return self.read(self.u8()).decode("ascii")
+
+
+def scrape(ser):
+    ser.reset_input_buffer()
+    ser.write(b"stats bin\r\n")
+    ser.read_until(b"MTR2")
+    r = Reader(ser)
+    (count,) = struct.unpack("<H", r.read(2))
+    metrics = []
+    for _ in range(count):
+        kind = TYPES[r.u8()]
+        m = {"name": r.string(), "unit": r.string(), "type": kind}
+        if kind == "histogram":
+            m["buckets"] = list(r.u32(BUCKETS))
+            low, high = r.u32(2)
+            m["sum"] = low | high << 32
+        elif kind == "timing":
+            m["count"], m["min"], m["max"], low, high = r.u32(5)
+            m["sum"] = low | high << 32
+            m["buckets"] = list(r.u32(TIMING_BUCKETS))
+        else:
+            (m["value"],) = r.u32()
+        metrics.append(m)
+    ser.read_until(b"ch> ")
+    return metrics
+
+
+def describe(m):
+    if m["type"] == "timing":
+        if m["count"] == 0:
+            return "%-20s %10d calls" % (m["name"], 0)
+        return "%-20s %10d calls, min %d, avg %d, max %d %s" % (
+            m["name"], m["count"], m["min"], m["sum"] // m["count"], m["max"], m["unit"])
+    if m["type"] != "histogram":
+        return "%-20s %10d %s" % (m["name"], m["value"], m["unit"])
+    count = sum(m["buckets"])
+    if count == 0:
+        return "%-20s %10d samples" % (m["name"], 0)
+    top = max(i for i, n in enumerate(m["buckets"]) if n)
+    if top == BUCKETS - 1:
+        # The last bucket is open ended.
+        bound = "max >= %d" % (1 << (top - 1))
+    else:
+        bound = "max < %d" % (1 << top)
+    return "%-20s %10d samples, avg %d, %s %s" % (
+        m["name"], count, m["sum"] // count, bound, m["unit"])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("port")
+    parser.add_argument("--json", action="store_true", help="print JSON")
+    parser.add_argument("--every", type=float, help="repeat every N seconds")
+    args = parser.parse_args()
+    with serial.Serial(args.port, timeout=2) as ser:
+        while True:
+            metrics = scrape(ser)
+            if args.json:
+                json.dump({"time": time.time(), "metrics": metrics}, sys.stdout)
+                print()
+            else:
+                print("\n".join(describe(m) for m in metrics))
+            if not args.every:
+                break
+            time.sleep(args.every)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Print a flat profile from a "prof dump" of the board.
+
+Addresses are resolved against the firmware ELF with the toolchain nm, the
+samples are summed per function. --lines resolves the hottest addresses to
+source lines with addr2line. --folded prints caller;function counts (from
+"prof start <Hz> lr") in the folded stack format read by flamegraph.pl,
+speedscope and the other tools that take collapsed perf output.
+
+    tools/prof.py PROF.TXT
+    tools/prof.py --port /dev/ttyACM0 --lines 20
+    tools/prof.py --port /dev/ttyACM0 --folded | flamegraph.pl > prof.svg
+"""
+
+import argparse
+import bisect
+import collections
+import subprocess
+import sys
+
+CROSS = "arm-none-eabi-"
+
+
+def capture(port):
+    """Run prof dump on the shell and return its lines."""
+    import serial
+
+    with serial.Serial(port, timeout=1) as ser:
+        ser.write(b"\r\n")
+        ser.read_until(b"ch> ")
+        ser.write(b"prof dump\r\n")
+        data = ser.read_until(b"ch> ")
+    return data.decode("ascii", "replace").splitlines()
+
+
+def parse(lines):
+    header, samples = None, []
+    for line in lines:
+        line = line.strip()
+        if line.startswith("# prof"):
+            header = line[2:]
+        elif line.startswith("P,"):
+            _, pc, lr, count = line.split(",")
+            samples.append((int(pc, 16), int(lr, 16), int(count)))
+    if header is None:
+        sys.exit("no prof dump found")
+    return header, samples
+
+
+class Symbols:
+    def __init__(self, elf, cross):
+        out = subprocess.run([cross + "nm", "-n", "-C", "--defined-only", elf],
+                             check=True, capture_output=True, text=True).stdout
+        self.addrs, self.names = [], []
+        for line in out.splitlines():
+            parts = line.split(None, 2)
+            if len(parts) == 3 and parts[1] in "tTwW":
+                self.addrs.append(int(parts[0], 16) & ~1)
+                self.names.append(parts[2])
+
+    def lookup(self, addr):
+        i = bisect.bisect_right(self.addrs, addr) - 1
+        return self.names[i] if i >= 0 else "0x%08x" % addr
+
+
+def addr2line(elf, cross, addrs):
+    out = subprocess.run([cross + "addr2line", "-e", elf] + ["0x%x" % a for a in addrs],
+                         check=True, capture_output=True, text=True).stdout
+    return out.splitlines()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file", nargs="?", help="prof dump, standard input by default")
+    parser.add_argument("--port", help="read the profile from the shell on this serial port")
+    parser.add_argument("--elf", default="build/ch.elf")
+    parser.add_argument("--cross", default=CROSS, help="toolchain prefix")
+    parser.add_argument("--lines", type=int, metavar="N", help="also print the N hottest lines")
+    parser.add_argument("--folded", action="store_true", help="print caller;function counts")
+    args = parser.parse_args()
+    if args.port:
+        lines = capture(args.port)
+    elif args.file:
+        with open(args.file) as f:
+            lines = f.read().splitlines()
+    else:
+        lines = sys.stdin.read().splitlines()
+    header, samples = parse(lines)
+    syms = Symbols(args.elf, args.cross)
+
+    if args.folded:
+        stacks = collections.Counter()
+        for pc, lr, count in samples:
+            # The return address follows the call, step back into it.
+            frames = [syms.lookup(lr - 2)] if lr else []
+            stacks[";".join(frames + [syms.lookup(pc)])] += count
+        for stack, count in stacks.most_common():
+            print(stack, count)
+        return
+
+    total = sum(c for _, _, c in samples) or 1
+    functions = collections.Counter()
+    pcs = collections.Counter()
+    for pc, _, count in samples:
+        functions[syms.lookup(pc)] += count
+        pcs[pc] += count
+    print(header)
+    print("%7s %8s  %s" % ("%", "samples", "function"))
+    for name, count in functions.most_common():
+        print("%6.2f%% %8d  %s" % (100.0 * count / total, count, name))
+    if args.lines:
+        hottest = pcs.most_common(args.lines)
+        print()
+        for (pc, count), where in zip(hottest, addr2line(args.elf, args.cross, [p for p, _ in hottest])):
+            print("%6.2f%% %8d  %08x %s" % (100.0 * count / total, count, pc, where))
+
+
+if __name__ == "__main__":
+    main()
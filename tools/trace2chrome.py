@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+"""Convert a trace dump of the board to the Chrome trace JSON format.
+
+The input is the output of "trace dump" captured from the shell, or the file
+written by "trace save". The result opens in chrome://tracing or Perfetto:
+one track per thread showing when it ran, one for interrupts seen while
+idle, one per SDIO and SPI transaction kind, and instant events for USB
+interrupts and user markers.
+
+    tools/trace2chrome.py TRACE.TXT > trace.json
+    tools/trace2chrome.py --port /dev/ttyACM0 > trace.json
+"""
+
+import argparse
+import json
+import sys
+
+PID = 1
+IRQ_TID = 1000
+SDIO_TID = 1001
+SPI_TID = 1002
+EVENTS_TID = 1003
+
+
+def capture(port):
+    """Run trace dump on the shell and return its lines."""
+    import serial
+
+    with serial.Serial(port, timeout=1) as ser:
+        ser.write(b"\r\n")
+        ser.read_until(b"ch> ")
+        ser.write(b"trace dump\r\n")
+        data = ser.read_until(b"ch> ")
+    return data.decode("ascii", "replace").splitlines()
+
+
+def parse(lines):
+    freq = None
+    threads = {}
+    records = []
+    for line in lines:
+        line = line.strip()
+        if line.startswith("# trace"):
+            freq = int(line.split()[2])
+        elif line.startswith("T,"):
+            _, addr, name = line.split(",", 2)
+            threads[int(addr, 16)] = name or addr
+        elif line and line[0].isdigit():
+            time, event, arg, data = line.split(",")
+            records.append((int(time), event, int(arg), int(data, 16)))
+    if freq is None:
+        sys.exit("no trace header found")
+    return freq, threads, records
+
+
+def unwrap(records):
+    """The cycle counter wraps every 2^32 cycles, make the times monotonic."""
+    out, base, last = [], 0, None
+    for time, event, arg, data in records:
+        if last is not None and time + base < last - (1 << 31):
+            base += 1 << 32
+        last = time + base
+        out.append((last, event, arg, data))
+    return out
+
+
+def convert(freq, threads, records):
+    us = 1e6 / freq
+    records = unwrap(records)
+    start = records[0][0] if records else 0
+    tids = {}
+    events = []
+
+    def ts(cycles):
+        return (cycles - start) * us
+
+    def tid(addr):
+        if addr not in tids:
+            tids[addr] = len(tids) + 1
+        return tids[addr]
+
+    running = None
+    pending = {}
+    for time, event, arg, data in records:
+        if event == "switch":
+            if running is not None:
+                events.append({"name": threads.get(running[0], "%08x" % running[0]),
+                               "ph": "X", "pid": PID, "tid": tid(running[0]),
+                               "ts": ts(running[1]), "dur": ts(time) - ts(running[1])})
+            running = (data, time)
+        elif event == "irq":
+            events.append({"name": "irq", "ph": "X", "pid": PID, "tid": IRQ_TID,
+                           "ts": ts(time), "dur": data * us})
+        elif event in ("sdio_read", "sdio_write", "spi"):
+            pending[SPI_TID if event == "spi" else SDIO_TID] = (event, time, arg, data)
+        elif event in ("sdio_end", "spi_end"):
+            track = SPI_TID if event == "spi_end" else SDIO_TID
+            if track in pending:
+                name, begin, n, sector = pending.pop(track)
+                args = {"blocks": n, "sector": sector, "error": arg} if track == SDIO_TID else {"accesses": n}
+                events.append({"name": name, "ph": "X", "pid": PID, "tid": track,
+                               "ts": ts(begin), "dur": ts(time) - ts(begin), "args": args})
+        else:
+            events.append({"name": "%s %d" % (event, arg), "ph": "i", "s": "t", "pid": PID,
+                           "tid": EVENTS_TID, "ts": ts(time), "args": {"data": data}})
+    names = {IRQ_TID: "interrupts (idle)", SDIO_TID: "sdio", SPI_TID: "spi", EVENTS_TID: "events"}
+    for addr, n in tids.items():
+        names[n] = threads.get(addr, "%08x" % addr)
+    for n, name in names.items():
+        events.append({"name": "thread_name", "ph": "M", "pid": PID, "tid": n,
+                       "args": {"name": name}})
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file", nargs="?", help="trace dump, standard input by default")
+    parser.add_argument("--port", help="read the trace from the shell on this serial port")
+    args = parser.parse_args()
+    if args.port:
+        lines = capture(args.port)
+    elif args.file:
+        with open(args.file) as f:
+            lines = f.read().splitlines()
+    else:
+        lines = sys.stdin.read().splitlines()
+    json.dump(convert(*parse(lines)), sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Measure the USB connect to shell prompt latency of the board.
+
+Waits for the CDC serial device to appear, opens it and times how long the
+shell takes to print its prompt. Run it against two firmware builds to
+compare them, replugging the board (or passing a --cycle command that
+power cycles the port, e.g. through uhubctl) between samples.
+
+    tools/usb_latency.py /dev/ttyACM0 -n 20
+    tools/usb_latency.py /dev/ttyACM0 -n 20 --cycle "uhubctl -l 1-1 -p 2 -a cycle"
+"""
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import time
+
+import serial
+
+PROMPT = b"ch> "
+
+
+def wait_for(predicate, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if predicate():
+            return True
+        time.sleep(0.001)
+    return False
+
+
+def sample(port, timeout):
+    """Seconds from the device node appearing to the prompt, None on timeout."""
+    if not wait_for(lambda: os.path.exists(port), timeout):
+        return None
+    start = time.monotonic()
+    # The node shows up before udev grants access, retry the open.
+    ser = None
+    while ser is None and time.monotonic() - start < timeout:
+        try:
+            ser = serial.Serial(port, timeout=0.01)
+        except serial.SerialException:
+            time.sleep(0.001)
+    if ser is None:
+        return None
+    data = b""
+    with ser:
+        while time.monotonic() - start < timeout:
+            data += ser.read(64)
+            if PROMPT in data:
+                return time.monotonic() - start
+            if not data:
+                # A shell already running prints the prompt on a new line.
+                ser.write(b"\r\n")
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("port", help="CDC device, e.g. /dev/ttyACM0")
+    parser.add_argument("-n", "--samples", type=int, default=10)
+    parser.add_argument("--cycle", help="command that power cycles the board")
+    parser.add_argument("--timeout", type=float, default=10.0)
+    args = parser.parse_args()
+
+    results = []
+    for i in range(args.samples):
+        if args.cycle:
+            subprocess.run(args.cycle, shell=True, check=True,
+                           stdout=subprocess.DEVNULL)
+            wait_for(lambda: not os.path.exists(args.port), args.timeout)
+        else:
+            print("replug the board...", file=sys.stderr)
+            wait_for(lambda: not os.path.exists(args.port), 3600)
+        t = sample(args.port, args.timeout)
+        if t is None:
+            print("%3d: timeout" % i)
+            continue
+        results.append(t * 1000)
+        print("%3d: %7.1f ms" % (i, results[-1]))
+
+    if results:
+        print("prompt latency: min %.1f ms, median %.1f ms, max %.1f ms (%d samples)"
+              % (min(results), statistics.median(results), max(results),
+                 len(results)))
+
+
+if __name__ == "__main__":
+    main()
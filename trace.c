@@ -0,0 +1,158 @@
+/*
+ * trace.c
+ *
+ *  Event trace in a RAM ring, timestamped with the DWT cycle counter.
+ *
+ *  The kernel hooks (chconf.h) record context switches and interrupted
+ *  passes of the idle loop, the drivers record their SPI and SDIO
+ *  transactions and the USB interrupt its events. A record is a few stores
+ *  with interrupts masked, callable from threads, interrupts and the locked
+ *  kernel alike.
+ *
+ *  trace dump prints the ring as text, trace save writes it to a file, and
+ *  tools/trace2chrome.py converts either to the Chrome trace JSON format
+ *  (chrome://tracing, Perfetto).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chprintf.h"
+
+#include "fat.h"
+#include "fwriter.h"
+#include "memmap.h"
+#include "trace.h"
+
+#if TRACE_ENABLE
+
+#if (TRACE_RECORDS & (TRACE_RECORDS - 1)) != 0
+#error "TRACE_RECORDS must be a power of two"
+#endif
+
+static CCM_DATA TraceRecord traceRing[TRACE_RECORDS];
+static uint32_t traceHead;          /* Records written since the clear.*/
+static bool_t traceOff;             /* Recording paused.*/
+
+static const char *traceEvents[TRACE_EV_COUNT] = {
+	"switch", "irq", "usb", "spi", "spi_end",
+	"sdio_read", "sdio_write", "sdio_end", "mark"
+};
+
+static void trace_record_at(uint32_t time, uint16_t event, uint16_t arg,
+		uint32_t data) {
+	TraceRecord *rp;
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if (!traceOff) {
+		rp = &traceRing[traceHead++ & (TRACE_RECORDS - 1)];
+		rp->time = time;
+		rp->data = data;
+		rp->event = event;
+		rp->arg = arg;
+	}
+	__set_PRIMASK(primask);
+}
+
+void traceRecord(uint16_t event, uint16_t arg, uint32_t data) {
+	trace_record_at(DWT->CYCCNT, event, arg, data);
+}
+
+/*
+ * From the context switch hook, the kernel is locked.
+ */
+void traceSwitch(Thread *ntp) {
+	trace_record_at(DWT->CYCCNT, TRACE_EV_SWITCH, (uint16_t)ntp->p_prio,
+		(uint32_t)ntp);
+}
+
+/*
+ * From the idle loop hook, an interrupt ran from start for cycles.
+ */
+void traceIrq(uint32_t start, uint32_t cycles) {
+	trace_record_at(start, TRACE_EV_IRQ, 0, cycles);
+}
+
+/*
+ * The thread table then the records, oldest first. Recording is paused
+ * meanwhile, the dump would otherwise overwrite what it prints.
+ */
+void traceDump(BaseSequentialStream *chp) {
+	TraceRecord r;
+	Thread *tp;
+	uint32_t i, n;
+	bool_t off = traceOff;
+
+	traceOff = TRUE;
+	n = traceHead < TRACE_RECORDS ? traceHead : TRACE_RECORDS;
+	chprintf(chp, "# trace %lu Hz %lu records\r\n",
+		(uint32_t)halGetCounterFrequency(), n);
+	tp = chRegFirstThread();
+	do {
+		chprintf(chp, "T,%.8lx,%s\r\n", (uint32_t)tp,
+			tp->p_name != NULL ? tp->p_name : "");
+		tp = chRegNextThread(tp);
+	} while (tp != NULL);
+	for (i = traceHead - n; i != traceHead; i++) {
+		r = traceRing[i & (TRACE_RECORDS - 1)];
+		chprintf(chp, "%lu,%s,%u,%.8lx\r\n", r.time,
+			r.event < TRACE_EV_COUNT ? traceEvents[r.event] : "?", r.arg, r.data);
+	}
+	traceOff = off;
+}
+
+static FRESULT trace_save(const char *path) {
+	static FileWriter fw;
+	static uint8_t buf[MMCSD_BLOCK_SIZE];   /* In SRAM, SDIO DMA source.*/
+	FRESULT err;
+
+	fwObjectInit(&fw, buf, sizeof(buf));
+	err = fwOpen(&fw, path, FA_WRITE | FA_CREATE_ALWAYS);
+	if (err != FR_OK) {
+		return err;
+	}
+	traceDump((BaseSequentialStream *)&fw);
+	if (fw.err != FR_OK) {
+		fwClose(&fw);
+		return fw.err;
+	}
+	return fwClose(&fw);
+}
+
+void cmd_trace(BaseSequentialStream *chp, int argc, char *argv[]) {
+	FRESULT err;
+	if (argc < 1) {
+		chprintf(chp, "%s, %lu records, %u kept\r\n", traceOff ? "paused" : "recording",
+			traceHead, TRACE_RECORDS);
+		chprintf(chp, "Usage: trace on|off|clear|dump|save file|mark [id]\r\n");
+		return;
+	}
+	if (strcmp(argv[0], "on") == 0) {
+		traceOff = FALSE;
+	} else if (strcmp(argv[0], "off") == 0) {
+		traceOff = TRUE;
+	} else if (strcmp(argv[0], "clear") == 0) {
+		chSysLock();
+		traceHead = 0;
+		chSysUnlock();
+	} else if (strcmp(argv[0], "dump") == 0) {
+		traceDump(chp);
+	} else if (strcmp(argv[0], "save") == 0 && argc == 2) {
+		err = trace_save(argv[1]);
+		if (err != FR_OK) {
+			chprintf(chp, "TRACE: saving to %s failed\r\n", argv[1]);
+			verbose_error(chp, err);
+		}
+	} else if (strcmp(argv[0], "mark") == 0) {
+		traceRecord(TRACE_EV_MARK, argc > 1 ? (uint16_t)atoi(argv[1]) : 0,
+			chTimeNow());
+	} else {
+		chprintf(chp, "Usage: trace on|off|clear|dump|save file|mark [id]\r\n");
+	}
+}
+
+#endif /* TRACE_ENABLE */
@@ -0,0 +1,64 @@
+/*
+ * trace.h
+ *
+ *  Event trace in a RAM ring, timestamped with the DWT cycle counter.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+ * TRACE_ENABLE is set in chconf.h, the context switch hook needs it.
+ */
+
+/**
+ * @brief   Records kept, a power of two. Older records are overwritten.
+ */
+#if !defined(TRACE_RECORDS)
+#define TRACE_RECORDS           512
+#endif
+
+/**
+ * @brief   Trace events.
+ */
+typedef enum {
+  TRACE_EV_SWITCH = 0,      /* Context switch, data: thread, arg: prio.     */
+  TRACE_EV_IRQ,             /* Interrupted idle loop, data: cycles.         */
+  TRACE_EV_USB,             /* USB event interrupt, arg: usbevent_t.        */
+  TRACE_EV_SPI_BEGIN,       /* SPI transaction, arg: register accesses.     */
+  TRACE_EV_SPI_END,
+  TRACE_EV_SDIO_READ,       /* SDIO transfer, data: sector, arg: blocks.    */
+  TRACE_EV_SDIO_WRITE,
+  TRACE_EV_SDIO_END,        /* data: sector, arg: error.                    */
+  TRACE_EV_MARK,            /* User marker, arg: id, data: value.           */
+  TRACE_EV_COUNT
+} traceevent_t;
+
+/**
+ * @brief   Trace record, 12 bytes.
+ */
+typedef struct {
+  uint32_t time;            /* DWT cycles.                                  */
+  uint32_t data;
+  uint16_t event;
+  uint16_t arg;
+} TraceRecord;
+
+/**
+ * @brief   Records an event, nothing when the trace is compiled out.
+ */
+#if TRACE_ENABLE
+#define TRACE(event, arg, data) traceRecord(event, arg, data)
+#else
+#define TRACE(event, arg, data)
+#endif
+
+#if TRACE_ENABLE
+void traceRecord(uint16_t event, uint16_t arg, uint32_t data);
+void traceSwitch(Thread *ntp);
+void traceIrq(uint32_t start, uint32_t cycles);
+void traceDump(BaseSequentialStream *chp);
+void cmd_trace(BaseSequentialStream *chp, int argc, char *argv[]);
+#endif
+
+#endif /* TRACE_H_ */
@@ -17,6 +17,14 @@
 #include "ch.h"
 #include "hal.h"
 
+#include "trace.h"
+#include "metrics.h"
+#include "boot.h"
+
+METRIC_COUNTER(usbResets, "usb.resets", "");
+METRIC_COUNTER(usbSuspends, "usb.suspends", "");
+METRIC_GAUGE(usbConfigured, "usb.configured", "");
+
 /*
  * Endpoints to be used for USBD1.
  */
@@ -258,18 +266,35 @@ static const USBEndpointConfig ep2config = {
   NULL
 };
 
+/*
+ * USB state changes, the shell lifecycle in main() waits on it.
+ */
+EVENTSOURCE_DECL(usbEvents);
+
+static void usb_broadcast(flagsmask_t flags) {
+  chSysLockFromIsr();
+  chEvtBroadcastFlagsI(&usbEvents, flags);
+  chSysUnlockFromIsr();
+}
+
 /*
  * Handles the USB driver global events.
  */
 static void usb_event(USBDriver *usbp, usbevent_t event) {
   extern SerialUSBDriver SDU1;
 
+  TRACE(TRACE_EV_USB, event, 0);
   switch (event) {
   case USB_EVENT_RESET:
+    metricInc(usbResets);
+    metricSet(usbConfigured, 0);
+    usb_broadcast(USBCFG_EVT_RESET);
     return;
   case USB_EVENT_ADDRESS:
     return;
   case USB_EVENT_CONFIGURED:
+    metricSet(usbConfigured, 1);
+    bootMark(BOOT_USB_CONFIGURED);
     chSysLockFromIsr();
 
     /* Enables the endpoints specified into the configuration.
@@ -281,11 +306,15 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
     /* Resetting the state of the CDC subsystem.*/
     sduConfigureHookI(&SDU1);
 
+    chEvtBroadcastFlagsI(&usbEvents, USBCFG_EVT_CONFIGURED);
     chSysUnlockFromIsr();
     return;
   case USB_EVENT_SUSPEND:
+    metricInc(usbSuspends);
+    usb_broadcast(USBCFG_EVT_SUSPEND);
     return;
   case USB_EVENT_WAKEUP:
+    usb_broadcast(USBCFG_EVT_WAKEUP);
     return;
   case USB_EVENT_STALLED:
     return;
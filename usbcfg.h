@@ -17,8 +17,17 @@
 #ifndef _USBCFG_H_
 #define _USBCFG_H_
 
+/*
+ * Flags broadcast on usbEvents by the USB driver event callback.
+ */
+#define USBCFG_EVT_RESET        (1 << 0)
+#define USBCFG_EVT_CONFIGURED   (1 << 1)
+#define USBCFG_EVT_SUSPEND      (1 << 2)
+#define USBCFG_EVT_WAKEUP       (1 << 3)
+
 extern const USBConfig usbcfg;
 extern SerialUSBConfig serusbcfg;
+extern EventSource usbEvents;
 
 #endif  /* _USBCFG_H_ */
 